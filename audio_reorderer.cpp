@@ -0,0 +1,182 @@
+#include <algorithm>
+
+#include "audio_reorderer.h"
+#include "fec.h"
+
+using namespace std;
+
+namespace {
+    // Blocks waiting at most, before the oldest one is given up.
+    const size_t max_pending = 4;
+    // A block this far from the expected one means the proxy started over.
+    const int32_t resync_blocks = 64;
+
+    // Distance between sequence numbers, correct when they wrap around.
+    int32_t distance(uint32_t from, uint32_t to) {
+        return (int32_t)(to - from);
+    }
+}
+
+AudioReorderer::AudioReorderer(Output output)
+    : output(output), started(false), next_block(0), next_datagram(0), counters() {}
+
+void AudioReorderer::reset() {
+    started = false;
+    pending.clear();
+}
+
+bool AudioReorderer::push(const RingSpan &message, long long received) {
+    AudioSequence sequence;
+    if (!decode_sequence(message, sequence) || sequence.fragment >= sequence.fragments)
+        return false;
+
+    int32_t ahead = distance(next_block, sequence.block);
+    if (started && (ahead >= resync_blocks || ahead <= -resync_blocks))
+        reset();
+    if (!started) {
+        started = true;
+        // Joining in the middle of a block, the output starts with the next one.
+        next_block = sequence.fragment == 0 ? sequence.block : sequence.block + 1;
+        next_datagram = sequence.datagram;
+        ahead = distance(next_block, sequence.block);
+    }
+
+    int32_t gap = distance(next_datagram, sequence.datagram);
+    if (gap >= 0) {
+        counters.lost_datagrams += gap;
+        next_datagram = sequence.datagram + 1;
+    } else {
+        counters.reordered++;
+        if (counters.lost_datagrams > 0)
+            counters.lost_datagrams--;
+    }
+
+    if (ahead < 0) {
+        counters.late++;
+        return true;
+    }
+
+    PendingBlock *block = find_block(sequence, received);
+    if (!block)
+        return false;
+    if (block->arrived[sequence.fragment]) {
+        counters.late++;
+        return true;
+    }
+    block->arrived[sequence.fragment] = true;
+    block->parts[sequence.fragment] = message.sub(SEQUENCE_SIZE, message.size() - SEQUENCE_SIZE).to_string();
+    block->missing--;
+    if (block->group_size > 0)
+        recover(*block, sequence.fragment / block->group_size);
+
+    flush();
+    return true;
+}
+
+bool AudioReorderer::push_parity(const RingSpan &message, long long received) {
+    AudioSequence sequence;
+    if (!decode_sequence(message, sequence))
+        return false;
+    ParityInfo info = decode_parity(sequence);
+    if (info.group_size == 0 || info.group * info.group_size >= sequence.fragments)
+        return false;
+
+    // Parity of blocks which went out, or of another stream, is of no use.
+    int32_t ahead = distance(next_block, sequence.block);
+    if (!started || ahead < 0 || ahead >= resync_blocks)
+        return true;
+
+    PendingBlock *block = find_block(sequence, received);
+    if (!block || (block->group_size != 0 && block->group_size != info.group_size))
+        return false;
+    block->group_size = info.group_size;
+    block->parity[info.group] = Parity{message.sub(SEQUENCE_SIZE, message.size() - SEQUENCE_SIZE).to_string(), info.length_xor};
+    recover(*block, info.group);
+
+    flush();
+    return true;
+}
+
+AudioReorderer::PendingBlock *AudioReorderer::find_block(const AudioSequence &sequence,
+                                                         long long received) {
+    PendingBlock &block = pending[sequence.block];
+    if (block.parts.empty()) {
+        block.parts.resize(sequence.fragments);
+        block.arrived.resize(sequence.fragments, false);
+        block.missing = sequence.fragments;
+        block.received = received;
+        block.group_size = 0;
+    } else if (block.parts.size() != sequence.fragments) {
+        return nullptr;
+    }
+    return &block;
+}
+
+void AudioReorderer::recover(PendingBlock &block, size_t group) {
+    auto it = block.parity.find(group);
+    if (it == block.parity.end())
+        return;
+
+    size_t first = group * block.group_size;
+    size_t last = min(first + block.group_size, block.parts.size());
+    size_t lost = last;
+    for (size_t f = first; f < last; f++) {
+        if (block.arrived[f])
+            continue;
+        if (lost != last)
+            return;
+        lost = f;
+    }
+    if (lost == last)
+        return;
+
+    // XOR of all fragments of the group, without the missing one, leaves the missing one.
+    string rebuilt = it->second.data;
+    size_t length = it->second.length_xor;
+    for (size_t f = first; f < last; f++) {
+        if (f == lost)
+            continue;
+        const string &part = block.parts[f];
+        if (part.size() > rebuilt.size())
+            return;
+        xor_into(&rebuilt[0], part.data(), part.size());
+        length ^= part.size();
+    }
+    if (length > rebuilt.size())
+        return;
+    rebuilt.resize(length);
+
+    block.parts[lost] = rebuilt;
+    block.arrived[lost] = true;
+    block.missing--;
+    counters.recovered++;
+}
+
+bool AudioReorderer::later_block_complete() const {
+    for (auto &entry : pending) {
+        if (entry.first != next_block && entry.second.missing == 0)
+            return true;
+    }
+    return false;
+}
+
+void AudioReorderer::flush() {
+    while (!pending.empty()) {
+        auto it = pending.find(next_block);
+        if (it != pending.end() && it->second.missing == 0) {
+            string audio;
+            for (auto &part : it->second.parts)
+                audio += part;
+            output(audio, it->second.received);
+            counters.blocks++;
+        } else if (later_block_complete() || pending.size() > max_pending) {
+            counters.dropped_blocks++;
+        } else {
+            break;
+        }
+
+        if (it != pending.end())
+            pending.erase(it);
+        next_block++;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef DUZE_AUDIO_REORDERER_H
+#define DUZE_AUDIO_REORDERER_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "network.h"
+
+// Counters of a reorderer.
+struct ReorderStats {
+    unsigned long long blocks;
+    // Blocks given up because some of their fragments did not come in time.
+    unsigned long long dropped_blocks;
+    // Datagrams missing from the sequence. Late datagrams are taken back out.
+    unsigned long long lost_datagrams;
+    // Datagrams which came after a datagram with a higher number.
+    unsigned long long reordered;
+    // Fragments of blocks already written or given up, and repeated fragments.
+    unsigned long long late;
+    // Fragments rebuilt from parity.
+    unsigned long long recovered;
+};
+
+// Puts AUDIO_SEQ fragments of a station back together and writes out whole
+// blocks in the order of their numbers. A fragment missing from a group covered
+// by a FEC message is rebuilt from it.
+// A block waits for its missing fragments until a later block is complete
+// or too many blocks are waiting, then it is given up, so that one lost
+// datagram costs a single block and never stalls the output.
+class AudioReorderer {
+public:
+    // Gets the audio of a block and the time its first fragment was received.
+    typedef std::function<void(const std::string &, long long)> Output;
+
+    explicit AudioReorderer(Output output);
+
+    // Takes an AUDIO_SEQ message received at @received.
+    // Returns false if the message is malformed.
+    bool push(const RingSpan &message, long long received);
+
+    // Takes a FEC message received at @received.
+    // Returns false if the message is malformed.
+    bool push_parity(const RingSpan &message, long long received);
+
+    // Forgets everything waiting, for a stream of another station.
+    void reset();
+
+    const ReorderStats &stats() const {
+        return counters;
+    }
+
+private:
+    struct Parity {
+        std::string data;
+        size_t length_xor;
+    };
+
+    struct PendingBlock {
+        std::vector<std::string> parts;
+        std::vector<bool> arrived;
+        uint16_t missing;
+        long long received;
+        // Fragments in a parity group, 0 before the first FEC message.
+        size_t group_size;
+        std::map<size_t, Parity> parity;
+    };
+
+    // Finds the block of a message, or starts collecting it.
+    // Returns null if the message does not match fragments already collected.
+    PendingBlock *find_block(const AudioSequence &sequence, long long received);
+
+    // Rebuilds the fragment of a given group if it's the only one missing.
+    void recover(PendingBlock &block, size_t group);
+
+    // Writes out complete blocks from the next one on, giving up blocks in the way if needed.
+    void flush();
+
+    // Whether a block after the next one is complete.
+    bool later_block_complete() const;
+
+    Output output;
+    bool started;
+    uint32_t next_block;
+    uint32_t next_datagram;
+    // Blocks which did not go out yet, keyed by their numbers.
+    std::map<uint32_t, PendingBlock> pending;
+    ReorderStats counters;
+};
+
+#endif //DUZE_AUDIO_REORDERER_H
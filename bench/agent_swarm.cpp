@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../err.h"
+#include "../my_time.h"
+#include "../network.h"
+#include "../reactor.h"
+#include "../socket_manager.h"
+
+using namespace std;
+
+// Simulates many agents of a radio-proxy for benchmarks. Every agent has its
+// own socket, sends a DISCOVER, then a KEEPALIVE every few seconds, and counts
+// the audio and metadata it gets. Prints one line of results at the end.
+// DISCOVERs are spread over time, as a burst of them would overflow the socket
+// buffer of the proxy, and repeated until the proxy answers. Data is counted only
+// after a warm-up, so that all agents are compared over the same time.
+// Loss is measured against the audio the stream carries at its bitrate over that
+// time. As audio comes in whole blocks, the estimate is off by up to a block.
+
+namespace {
+    const long long keepalive_period = 2000000;
+    const int receive_buffer = 1 << 20;
+    // Number of agents starting every millisecond.
+    const size_t discover_batch = 32;
+    const long long warm_up = 1000000;
+
+    bool counting = false;
+    long long counting_started = 0;
+
+    struct Agent {
+        int sock;
+        unsigned long long audio_bytes;
+        unsigned long long metadata_bytes;
+        unsigned long long datagrams;
+        bool answered;
+    };
+
+    struct Settings {
+        string host = "127.0.0.1";
+        int port = 0;
+        int agents = 10;
+        int seconds = 10;
+        // Of the audio of the stream, in kbit/s, like that given to fake-icecast.
+        int bitrate = 128;
+    };
+
+    void print_usage() {
+        cerr << "Usage: ./agent-swarm -P port [-H host] [-n agents] [-d seconds_after_warm_up] [-b bitrate_kbps]" << endl;
+        exit(1);
+    }
+
+    void send_to_proxy(int sock, const sockaddr_in &proxy, uint16_t type) {
+        char header[4] = {};
+        type = htons(type);
+        memcpy(header, &type, 2);
+        if (sendto(sock, header, sizeof header, 0, (const sockaddr *)&proxy, sizeof proxy) < 0)
+            syserr("sendto");
+    }
+
+    // Reads every datagram waiting for @agent.
+    void receive(Agent &agent) {
+        char datagram[65536];
+        while (true) {
+            ssize_t length = recv(agent.sock, datagram, sizeof datagram, 0);
+            if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (length < 0)
+                syserr("recv");
+            if (length < 4)
+                continue;
+
+            uint16_t type;
+            memcpy(&type, datagram, 2);
+            type = ntohs(type);
+            if (type == IAM)
+                agent.answered = true;
+            if (!counting)
+                continue;
+
+            agent.datagrams++;
+            if (type == AUDIO)
+                agent.audio_bytes += length - 4;
+            else if (type == METADATA)
+                agent.metadata_bytes += length - 4;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Settings settings;
+    int option;
+    while ((option = getopt(argc, argv, "H:P:n:d:b:")) != -1) {
+        switch (option) {
+            case 'H': settings.host = optarg; break;
+            case 'P': settings.port = atoi(optarg); break;
+            case 'n': settings.agents = atoi(optarg); break;
+            case 'd': settings.seconds = atoi(optarg); break;
+            case 'b': settings.bitrate = atoi(optarg); break;
+            default: print_usage();
+        }
+    }
+    if (settings.port <= 0 || settings.agents <= 0 || settings.seconds <= 0 || settings.bitrate <= 0)
+        print_usage();
+
+    sockaddr_in proxy = {};
+    proxy.sin_family = AF_INET;
+    proxy.sin_port = htons(settings.port);
+    if (inet_aton(settings.host.c_str(), &proxy.sin_addr) == 0)
+        fatal("inet_aton - invalid address");
+
+    Reactor reactor;
+    vector<Agent> agents(settings.agents, Agent{-1, 0, 0, 0, false});
+    for (size_t i = 0; i < agents.size(); i++) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0)
+            syserr("socket");
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof receive_buffer);
+        set_nonblocking(sock);
+        agents[i].sock = sock;
+        reactor.add(sock, EPOLLIN, [&agents, i](uint32_t) {
+            receive(agents[i]);
+        });
+    }
+
+    size_t started = 0;
+    int discover_timer = reactor.create_timer([&]() {
+        for (size_t i = 0; i < discover_batch && started < agents.size(); i++, started++)
+            send_to_proxy(agents[started].sock, proxy, DISCOVER);
+        if (started < agents.size())
+            reactor.arm_timer(discover_timer, 1000);
+    });
+    reactor.arm_timer(discover_timer, 0);
+
+    int keepalive_timer = reactor.create_timer([&]() {
+        for (auto &agent : agents)
+            send_to_proxy(agent.sock, proxy, agent.answered ? KEEPALIVE : DISCOVER);
+        reactor.arm_timer(keepalive_timer, keepalive_period);
+    });
+    reactor.arm_timer(keepalive_timer, keepalive_period);
+
+    int warm_up_timer = reactor.create_timer([]() {
+        counting = true;
+        counting_started = now_usec();
+    });
+    reactor.arm_timer(warm_up_timer, warm_up);
+
+    bool finished = false;
+    int end_timer = reactor.create_timer([&finished]() {
+        finished = true;
+    });
+    reactor.arm_timer(end_timer, warm_up + settings.seconds * 1000000ll);
+
+    reactor.run(finished);
+    long long counted_usec = now_usec() - counting_started;
+
+    unsigned long long total = 0, least = agents[0].audio_bytes, most = 0, metadata = 0, datagrams = 0;
+    for (auto &agent : agents) {
+        total += agent.audio_bytes;
+        least = min(least, agent.audio_bytes);
+        most = max(most, agent.audio_bytes);
+        metadata += agent.metadata_bytes;
+        datagrams += agent.datagrams;
+        close_socket(agent.sock);
+    }
+
+    // Every agent should get all audio the server sent while the agents counted.
+    double expected = settings.bitrate * 1000.0 / 8 * counted_usec / 1000000;
+    double loss = max(0.0, 1 - total / (expected * agents.size()));
+    cout << "agents " << agents.size() << " audio_bytes " << total << " min " << least
+         << " max " << most << " metadata_bytes " << metadata << " datagrams " << datagrams
+         << " loss " << loss << " expected_bytes " << (unsigned long long)expected << endl;
+}
@@ -0,0 +1,144 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "../err.h"
+
+using namespace std;
+
+// Emulates an Icecast server for benchmarks, streaming generated audio to every
+// client at a fixed bitrate, with metadata changing every few blocks.
+
+namespace {
+    // How often a piece of the stream is sent.
+    const long long tick_usec = 10000;
+
+    struct Settings {
+        int port = 0;
+        int bitrate = 128;
+        int metaint = 8192;
+        int churn = 4;
+    };
+
+    void print_usage() {
+        cerr << "Usage: ./fake-icecast -p port [-b bitrate_kbps] [-m metaint] [-c churn_blocks]" << endl;
+        exit(1);
+    }
+
+    // Writes all of @data. Returns false if the client went away.
+    bool write_all(int sock, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = send(sock, data, size, MSG_NOSIGNAL);
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // Returns the metadata block following audio block @block.
+    string metadata_block(const Settings &settings, long long block) {
+        if (settings.churn == 0 || block % settings.churn != 0)
+            return string(1, '\0');
+        string title = "StreamTitle='Bench song " + to_string(block / settings.churn) + "';";
+        size_t length = (title.size() + 15) / 16;
+        title.resize(16 * length, '\0');
+        return string(1, (char)length) + title;
+    }
+
+    // Streams to a single client until it goes away.
+    void serve(int sock, Settings settings) {
+        char request[4096];
+        ssize_t length = read(sock, request, sizeof request - 1);
+        if (length <= 0) {
+            close(sock);
+            return;
+        }
+        request[length] = '\0';
+        bool metadata = strstr(request, "Icy-MetaData:1") != nullptr;
+
+        string header = "ICY 200 OK\r\nicy-name:Bench Radio\r\n";
+        if (metadata)
+            header += "icy-metaint:" + to_string(settings.metaint) + "\r\n";
+        header += "\r\n";
+
+        string audio(settings.metaint, '\0');
+        for (size_t i = 0; i < audio.size(); i++)
+            audio[i] = (char)(i * 7);
+
+        long long per_tick = settings.bitrate * 1000ll / 8 * tick_usec / 1000000;
+        long long position = 0, block = 0;
+        timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+
+        bool connected = write_all(sock, header.data(), header.size());
+        while (connected) {
+            string piece;
+            for (long long left = per_tick; left > 0;) {
+                long long taken = min(left, settings.metaint - position);
+                piece.append(audio, position, taken);
+                position += taken;
+                left -= taken;
+                if (position == settings.metaint) {
+                    position = 0;
+                    block++;
+                    if (metadata)
+                        piece += metadata_block(settings, block);
+                }
+            }
+            connected = write_all(sock, piece.data(), piece.size());
+
+            next.tv_nsec += tick_usec * 1000;
+            if (next.tv_nsec >= 1000000000) {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+        }
+        close(sock);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Settings settings;
+    int option;
+    while ((option = getopt(argc, argv, "p:b:m:c:")) != -1) {
+        switch (option) {
+            case 'p': settings.port = atoi(optarg); break;
+            case 'b': settings.bitrate = atoi(optarg); break;
+            case 'm': settings.metaint = atoi(optarg); break;
+            case 'c': settings.churn = atoi(optarg); break;
+            default: print_usage();
+        }
+    }
+    if (settings.port <= 0 || settings.bitrate <= 0 || settings.metaint <= 0 || settings.churn < 0)
+        print_usage();
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        syserr("socket");
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(settings.port);
+    if (bind(listener, (sockaddr *)&address, sizeof address) < 0)
+        syserr("bind");
+    if (listen(listener, 16) < 0)
+        syserr("listen");
+
+    while (true) {
+        int sock = accept(listener, nullptr, nullptr);
+        if (sock < 0)
+            syserr("accept");
+        thread(serve, sock, settings).detach();
+    }
+}
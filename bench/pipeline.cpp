@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "../err.h"
+#include "../my_time.h"
+#include "../pipeline.h"
+
+using namespace std;
+
+// Measures the cost per byte of taking an ICY stream apart and handing its blocks
+// to a sink, with the pipeline specialized at compile time by relay_blocks and with
+// the generic loop which checks the metadata mode and the sink for every block.
+// The stream is generated in memory and fed to a demuxer in pieces, like reads
+// from a socket would do, so no system calls are measured except those of the sinks.
+
+namespace {
+    // Size of a single piece of the stream fed to the demuxer.
+    const size_t read_size = 4096;
+    // Both loops are measured in turns this many times, and the best time counts.
+    const int rounds = 5;
+
+    struct Settings {
+        int metaint = 8192;
+        int megabytes = 64;
+        int churn = 4;
+    };
+
+    void print_usage() {
+        cerr << "Usage: ./pipeline [-m metaint] [-n megabytes] [-c churn_blocks]" << endl;
+        exit(1);
+    }
+
+    // Returns @megabytes of an ICY stream, with metadata if @metadata is set.
+    string make_stream(const Settings &settings, bool metadata) {
+        string stream;
+        size_t size = settings.megabytes * 1000000ull;
+        stream.reserve(size + settings.metaint);
+        for (long long block = 1; stream.size() < size; block++) {
+            for (int i = 0; i < settings.metaint; i++)
+                stream += (char)(i * 7);
+            if (!metadata)
+                continue;
+            if (settings.churn == 0 || block % settings.churn != 0) {
+                stream += '\0';
+            } else {
+                string title = "StreamTitle='Bench song " + to_string(block / settings.churn) + "';";
+                size_t length = (title.size() + 15) / 16;
+                title.resize(16 * length, '\0');
+                stream += (char)length + title;
+            }
+        }
+        return stream;
+    }
+
+    // Counts the bytes it gets, which is the least any sink does.
+    struct CountSink {
+        unsigned long long bytes = 0;
+
+        void audio(const RingSpan &data) {
+            bytes += data.size();
+        }
+
+        void metadata(const RingSpan &data) {
+            bytes += data.size();
+        }
+    };
+
+    // Copies blocks into strings, like blocks published to the shards.
+    struct CopySink {
+        string last;
+
+        void audio(const RingSpan &data) {
+            last = data.to_string();
+        }
+
+        void metadata(const RingSpan &data) {
+            if (data.size() > 1)
+                last = data.to_string();
+        }
+    };
+
+    // Writes blocks to a file, like the standard outputs without agents.
+    struct WriteSink {
+        FILE *file;
+
+        void audio(const RingSpan &data) {
+            for (int i = 0; i < 2; i++)
+                fwrite(data.part[i], sizeof(char), data.part_size[i], file);
+        }
+
+        void metadata(const RingSpan &data) {
+            audio(data);
+        }
+    };
+
+    // The loop before specialization: the demuxer checks its metadata mode and
+    // the loop checks where blocks go on every block.
+    template <class Sink>
+    size_t relay_generic(IcyDemuxer &demuxer, bool agents, Sink &sink) {
+        IcyBlock block;
+        size_t blocks = 0;
+        while (demuxer.next(block)) {
+            blocks++;
+            if (agents) {
+                if (block.type == METADATA)
+                    sink.metadata(block.data);
+                else
+                    sink.audio(block.data);
+            } else if (block.type == METADATA) {
+                sink.metadata(block.data);
+            } else {
+                sink.audio(block.data);
+            }
+        }
+        return blocks;
+    }
+
+    // Feeds @stream to a new demuxer, relaying blocks after every piece with @relay.
+    // Returns the time taken per byte, in nanoseconds.
+    template <class Relay>
+    double measure(const Settings &settings, const string &stream, bool metadata, Relay relay) {
+        IcyDemuxer demuxer(settings.metaint, metadata);
+        size_t blocks = 0;
+        long long start = now_usec();
+        for (size_t position = 0; position < stream.size(); position += read_size) {
+            size_t length = min(read_size, stream.size() - position);
+            demuxer.buffer().append(stream.data() + position, length);
+            blocks += relay(demuxer);
+        }
+        long long elapsed = now_usec() - start;
+        if (blocks == 0)
+            cerr << "No blocks relayed\n";
+        return 1000.0 * elapsed / stream.size();
+    }
+
+    // Measures both loops with a given sink and prints a line of results.
+    template <bool Metadata, class Sink>
+    void compare(const Settings &settings, const string &stream, const char *name, Sink sink) {
+        // Read from memory the compiler cannot see through, like params of the proxy.
+        volatile bool agents_flag = false;
+        bool agents = agents_flag;
+
+        Sink generic_sink = sink, specialized_sink = sink;
+        double generic = 1e9, specialized = 1e9;
+        for (int round = 0; round < rounds; round++) {
+            generic = min(generic, measure(settings, stream, Metadata, [&](IcyDemuxer &demuxer) {
+                return relay_generic(demuxer, agents, generic_sink);
+            }));
+            specialized = min(specialized, measure(settings, stream, Metadata, [&](IcyDemuxer &demuxer) {
+                return relay_blocks<Metadata>(demuxer, specialized_sink);
+            }));
+        }
+        printf("%8s %6s %12.4f %12.4f %8.1f%%\n", Metadata ? "yes" : "no", name, generic, specialized,
+               100 * (generic - specialized) / generic);
+    }
+
+    template <bool Metadata>
+    void compare_sinks(const Settings &settings, FILE *null_file) {
+        string stream = make_stream(settings, Metadata);
+        compare<Metadata>(settings, stream, "count", CountSink());
+        compare<Metadata>(settings, stream, "copy", CopySink());
+        compare<Metadata>(settings, stream, "write", WriteSink{null_file});
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Settings settings;
+    int option;
+    while ((option = getopt(argc, argv, "m:n:c:")) != -1) {
+        switch (option) {
+            case 'm': settings.metaint = atoi(optarg); break;
+            case 'n': settings.megabytes = atoi(optarg); break;
+            case 'c': settings.churn = atoi(optarg); break;
+            default: print_usage();
+        }
+    }
+    if (settings.metaint <= 0 || settings.megabytes <= 0 || settings.churn < 0)
+        print_usage();
+
+    FILE *null_file = fopen("/dev/null", "w");
+    if (!null_file)
+        syserr("fopen");
+
+    printf("%8s %6s %12s %12s %9s\n", "metadata", "sink", "generic_ns/B", "special_ns/B", "gain");
+    compare_sinks<false>(settings, null_file);
+    compare_sinks<true>(settings, null_file);
+    fclose(null_file);
+}
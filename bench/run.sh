@@ -0,0 +1,64 @@
+#!/bin/bash
+# Runs radio-proxy against a local fake Icecast server and swarms of agents
+# of growing size, printing one line of results per swarm.
+# Everything runs on the loopback interface, no network access is needed.
+#
+# Settings come from the environment:
+#   BENCH_AGENTS   swarm sizes (default "1 10 100 500")
+#   BENCH_SECONDS  duration of a single run (default 10)
+#   BENCH_BITRATE  stream bitrate in kbit/s (default 128)
+#   BENCH_METAINT  metadata interval (default 8192)
+#   BENCH_CHURN    blocks between metadata changes, 0 for none (default 4)
+#   BENCH_PROXY_ARGS  additional radio-proxy options, like "-S 4"
+
+cd "$(dirname "$0")/.." || exit 1
+
+AGENTS=${BENCH_AGENTS:-"1 10 100 500"}
+SECONDS_PER_RUN=${BENCH_SECONDS:-10}
+BITRATE=${BENCH_BITRATE:-128}
+METAINT=${BENCH_METAINT:-8192}
+CHURN=${BENCH_CHURN:-4}
+SERVER_PORT=${BENCH_SERVER_PORT:-18100}
+AGENT_PORT=${BENCH_AGENT_PORT:-18101}
+
+./bench/fake-icecast -p "$SERVER_PORT" -b "$BITRATE" -m "$METAINT" -c "$CHURN" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.3
+
+# Prints the CPU time used by process $1 so far, in clock ticks.
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Prints the value of field $1 of a STATS report.
+stat_field() {
+    grep "^$1:" <<< "$REPORT" | cut -d' ' -f2
+}
+
+TICKS=$(getconf CLK_TCK)
+printf "%8s %8s %12s %12s %10s %10s %10s %10s\n" agents cpu% kbit/s/agent datagrams/s loss p50_us p99_us p999_us
+
+for N in $AGENTS; do
+    # shellcheck disable=SC2086
+    ./radio-proxy -h 127.0.0.1 -r / -p "$SERVER_PORT" -m yes -P "$AGENT_PORT" -T 5 $BENCH_PROXY_ARGS \
+        2>/dev/null &
+    PROXY=$!
+    sleep 0.5
+
+    START=$(cpu_ticks $PROXY)
+    RESULT=$(./bench/agent-swarm -P "$AGENT_PORT" -n "$N" -d "$SECONDS_PER_RUN" -b "$BITRATE")
+    END=$(cpu_ticks $PROXY)
+    REPORT=$(./radio-stats -H 127.0.0.1 -P "$AGENT_PORT")
+
+    kill -INT $PROXY
+    wait $PROXY 2>/dev/null
+
+    AUDIO=$(awk '{ print $4 }' <<< "$RESULT")
+    LOSS=$(awk '{ print $14 }' <<< "$RESULT")
+    # The swarm runs for a second of warm-up on top of the measured time.
+    CPU=$(awk -v t=$((END - START)) -v hz="$TICKS" -v s=$((SECONDS_PER_RUN + 1)) 'BEGIN { printf "%.1f", 100 * t / hz / s }')
+    RATE=$(awk -v b="$AUDIO" -v n="$N" -v s="$SECONDS_PER_RUN" 'BEGIN { printf "%.1f", 8 * b / n / s / 1000 }')
+    printf "%8s %8s %12s %12s %10s %10s %10s %10s\n" "$N" "$CPU" "$RATE" "$(stat_field datagrams_per_sec)" \
+        "$LOSS" "$(stat_field latency_p50_usec)" "$(stat_field latency_p99_usec)" "$(stat_field latency_p999_usec)"
+done
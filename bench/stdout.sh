@@ -0,0 +1,52 @@
+#!/bin/bash
+# Runs radio-proxy without agents against a local fake Icecast server, with its
+# standard output piped to a reader, once copying audio through user space and
+# once splicing it. Prints one line of results per mode.
+#
+# Settings come from the environment:
+#   BENCH_SECONDS  duration of a single run (default 10)
+#   BENCH_BITRATE  stream bitrate in kbit/s (default 200000)
+#   BENCH_METAINT  metadata interval (default 65536)
+#   BENCH_CHURN    blocks between metadata changes, 0 for none (default 4)
+
+cd "$(dirname "$0")/.." || exit 1
+
+SECONDS_PER_RUN=${BENCH_SECONDS:-10}
+BITRATE=${BENCH_BITRATE:-200000}
+METAINT=${BENCH_METAINT:-65536}
+CHURN=${BENCH_CHURN:-4}
+SERVER_PORT=${BENCH_SERVER_PORT:-18100}
+
+./bench/fake-icecast -p "$SERVER_PORT" -b "$BITRATE" -m "$METAINT" -c "$CHURN" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.3
+
+# Prints the CPU time used by process $1 so far, in clock ticks.
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+TICKS=$(getconf CLK_TCK)
+printf "%8s %8s %12s\n" mode cpu% MB/s
+
+for SPLICE in no yes; do
+    COUNT=$(mktemp)
+    ./radio-proxy -h 127.0.0.1 -r / -p "$SERVER_PORT" -m yes -Z "$SPLICE" 2>/dev/null | wc -c > "$COUNT" &
+    READER=$!
+    sleep 0.2
+    PROXY=$(pgrep -n -x radio-proxy)
+
+    START=$(cpu_ticks "$PROXY")
+    sleep "$SECONDS_PER_RUN"
+    END=$(cpu_ticks "$PROXY")
+    kill -INT "$PROXY"
+    wait $READER
+
+    MODE=$([ "$SPLICE" = yes ] && echo splice || echo copy)
+    # The reader also counts the bytes from before the measured time.
+    CPU=$(awk -v t=$((END - START)) -v hz="$TICKS" -v s="$SECONDS_PER_RUN" 'BEGIN { printf "%.1f", 100 * t / hz / s }')
+    RATE=$(awk -v b="$(cat "$COUNT")" -v s="$SECONDS_PER_RUN" 'BEGIN { printf "%.1f", b / s / 1000000 }')
+    printf "%8s %8s %12s\n" "$MODE" "$CPU" "$RATE"
+    rm -f "$COUNT"
+done
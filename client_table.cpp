@@ -0,0 +1,123 @@
+#include "client_table.h"
+
+using namespace std;
+
+namespace {
+    const size_t initial_slots = 64;
+
+    size_t hash_key(uint64_t key, size_t mask) {
+        return (key * 0x9E3779B97F4A7C15ull >> 17) & mask;
+    }
+}
+
+uint64_t client_key(const sockaddr_in &address) {
+    return (uint64_t)address.sin_addr.s_addr << 16 | address.sin_port;
+}
+
+ClientTable::ClientTable(TimerWheel &timers, long long timeout)
+    : slots(initial_slots, 0), timers(timers), timeout(timeout), expired(0), changes(0),
+      snapshot_version(0) {}
+
+AddressSnapshot ClientTable::snapshot() {
+    if (!last_snapshot || snapshot_version != changes) {
+        last_snapshot = make_shared<const vector<sockaddr_in>>(addrs);
+        snapshot_version = changes;
+    }
+    return last_snapshot;
+}
+
+size_t ClientTable::find_slot(uint64_t key) const {
+    size_t mask = slots.size() - 1;
+    size_t slot = hash_key(key, mask);
+    while (slots[slot] != 0 && keys[slots[slot] - 1] != key)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+void ClientTable::grow() {
+    slots.assign(2 * slots.size(), 0);
+    for (size_t i = 0; i < keys.size(); i++)
+        slots[find_slot(keys[i])] = i + 1;
+}
+
+void ClientTable::add(const sockaddr_in &address, long long now) {
+    uint64_t key = client_key(address);
+    size_t slot = find_slot(key);
+    if (slots[slot] != 0) {
+        timers.schedule(expiry_timers[slots[slot] - 1], now + timeout);
+        return;
+    }
+
+    int timer = timers.create([this, key]() {
+        expire(key);
+    });
+    timers.schedule(timer, now + timeout);
+
+    keys.push_back(key);
+    addrs.push_back(address);
+    expiry_timers.push_back(timer);
+    slots[slot] = keys.size();
+    changes++;
+
+    // Keeps the load factor at most one half, so probes stay short.
+    if (2 * keys.size() > slots.size())
+        grow();
+}
+
+bool ClientTable::touch(const sockaddr_in &address, long long now) {
+    size_t slot = find_slot(client_key(address));
+    if (slots[slot] == 0)
+        return false;
+    timers.schedule(expiry_timers[slots[slot] - 1], now + timeout);
+    return true;
+}
+
+bool ClientTable::contains(const sockaddr_in &address) const {
+    return slots[find_slot(client_key(address))] != 0;
+}
+
+bool ClientTable::remove(const sockaddr_in &address) {
+    size_t slot = find_slot(client_key(address));
+    if (slots[slot] == 0)
+        return false;
+    remove_at(slots[slot] - 1);
+    return true;
+}
+
+void ClientTable::remove_at(size_t position) {
+    size_t mask = slots.size() - 1;
+    timers.destroy(expiry_timers[position]);
+
+    // Empties the slot and shifts back the entries that probed past it.
+    size_t hole = find_slot(keys[position]);
+    slots[hole] = 0;
+    for (size_t slot = (hole + 1) & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+        size_t home = hash_key(keys[slots[slot] - 1], mask);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            slots[hole] = slots[slot];
+            slots[slot] = 0;
+            hole = slot;
+        }
+    }
+
+    // Moves the last client into the freed position.
+    size_t last = keys.size() - 1;
+    if (position != last) {
+        slots[find_slot(keys[last])] = position + 1;
+        keys[position] = keys[last];
+        addrs[position] = addrs[last];
+        expiry_timers[position] = expiry_timers[last];
+    }
+    keys.pop_back();
+    addrs.pop_back();
+    expiry_timers.pop_back();
+    changes++;
+}
+
+void ClientTable::expire(uint64_t key) {
+    size_t slot = find_slot(key);
+    if (slots[slot] != 0) {
+        remove_at(slots[slot] - 1);
+        expired++;
+    }
+}
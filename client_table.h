@@ -0,0 +1,86 @@
+#ifndef DUZE_CLIENT_TABLE_H
+#define DUZE_CLIENT_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <vector>
+
+#include "timer_wheel.h"
+
+// Addresses of clients at some point, shared by sends which outlive changes of the table.
+typedef std::shared_ptr<const std::vector<sockaddr_in>> AddressSnapshot;
+
+// Registry of clients keyed by their binary address.
+// Clients are stored densely as a structure of arrays, so fan-out scans walk
+// contiguous memory. An open-addressed index maps addresses to positions in the arrays.
+// Every client has an expiry timer in the given wheel, pushed back each time
+// the client is refreshed, so refreshing never allocates and only clients that
+// actually expire cost any work.
+class ClientTable {
+public:
+    // Clients not refreshed for @timeout microseconds are removed.
+    ClientTable(TimerWheel &timers, long long timeout);
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    // Registers a client, or refreshes it if it's already known.
+    void add(const sockaddr_in &address, long long now);
+
+    // Refreshes a known client. Returns false if the client is not registered.
+    bool touch(const sockaddr_in &address, long long now);
+
+    // Removes a client. Returns false if the client is not registered.
+    bool remove(const sockaddr_in &address);
+
+    // Checks if a client is registered.
+    bool contains(const sockaddr_in &address) const;
+
+    // Number of clients removed because they were not refreshed in time.
+    unsigned long long expirations() const {
+        return expired;
+    }
+
+    // Addresses of all clients, in a single contiguous array.
+    const sockaddr_in *addresses() const {
+        return addrs.data();
+    }
+
+    // Copy of the addresses of all clients. The copy is made once for every version
+    // of the table, and shared by everyone asking until the table changes.
+    AddressSnapshot snapshot();
+
+private:
+    // Finds the slot of a given key, or the empty slot where it belongs.
+    size_t find_slot(uint64_t key) const;
+
+    // Removes the client stored at position @position.
+    void remove_at(size_t position);
+
+    // Removes the client with a given key, called when its timer expires.
+    void expire(uint64_t key);
+
+    void grow();
+
+    std::vector<uint64_t> keys;
+    std::vector<sockaddr_in> addrs;
+    std::vector<int> expiry_timers;
+
+    // Positions of clients increased by one, 0 marks an empty slot.
+    std::vector<uint32_t> slots;
+
+    TimerWheel &timers;
+    long long timeout;
+    unsigned long long expired;
+    // Grows whenever a client is added or removed.
+    unsigned long long changes;
+    AddressSnapshot last_snapshot;
+    unsigned long long snapshot_version;
+};
+
+// Packs the address and port of a client into a single number.
+uint64_t client_key(const sockaddr_in &address);
+
+#endif //DUZE_CLIENT_TABLE_H
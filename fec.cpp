@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "fec.h"
+
+using namespace std;
+
+namespace {
+    // Lets the compiler use the widest vector registers the target has.
+    typedef uint64_t Lanes __attribute__((vector_size(32)));
+}
+
+void xor_into(char *parity, const char *data, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(Lanes) <= size; i += sizeof(Lanes)) {
+        Lanes a, b;
+        memcpy(&a, parity + i, sizeof a);
+        memcpy(&b, data + i, sizeof b);
+        a ^= b;
+        memcpy(parity + i, &a, sizeof a);
+    }
+    for (; i < size; i++)
+        parity[i] ^= data[i];
+}
+
+vector<string> encode_parity(const string &audio, const AudioSequence &sequence, size_t group) {
+    size_t payload = udp_fragment_payload(true);
+    size_t fragments = udp_fragments(audio.size(), true);
+
+    vector<string> messages;
+    for (size_t first = 0; first < fragments; first += group) {
+        size_t last = min(first + group, fragments);
+        // Only the last fragment of a block is shorter, so the first one is the longest.
+        size_t longest = min(audio.size() - first * payload, payload);
+        string message(SEQUENCE_SIZE + longest, '\0');
+        char *parity = &message[SEQUENCE_SIZE];
+        uint16_t length_xor = 0;
+        for (size_t f = first; f < last; f++) {
+            size_t position = f * payload;
+            size_t length = min(audio.size() - position, payload);
+            xor_into(parity, audio.data() + position, length);
+            length_xor ^= length;
+        }
+
+        AudioSequence header = sequence;
+        header.datagram = (uint32_t)group << 16 | length_xor;
+        header.fragment = first / group;
+        header.fragments = fragments;
+        encode_sequence(header, &message[0]);
+        messages.push_back(message);
+    }
+    return messages;
+}
+
+ParityInfo decode_parity(const AudioSequence &sequence) {
+    return ParityInfo{sequence.fragment, sequence.datagram >> 16, sequence.datagram & 0xFFFF};
+}
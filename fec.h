@@ -0,0 +1,38 @@
+#ifndef DUZE_FEC_H
+#define DUZE_FEC_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "network.h"
+
+// XOR parity of audio blocks sent as AUDIO_SEQ.
+// Fragments of a block are split into groups of a given size, and every group
+// gets one FEC datagram, which lets a client rebuild one lost fragment of the group.
+// A FEC message is an AudioSequence of the block, whose fragment field is
+// the number of the group and whose datagram field holds the group size in the
+// upper half and the XOR of the lengths of the group's fragments in the lower
+// half, followed by the XOR of the fragments padded with zeros.
+
+// Largest number of fragments in a group.
+const int LIMIT_FEC_GROUP = 255;
+
+// XORs @size bytes from @data into @parity.
+void xor_into(char *parity, const char *data, size_t size);
+
+// Returns FEC messages of a block numbered by @sequence, for groups of @group fragments.
+std::vector<std::string> encode_parity(const std::string &audio, const AudioSequence &sequence,
+                                       size_t group);
+
+// Fields of a FEC message.
+struct ParityInfo {
+    size_t group;
+    size_t group_size;
+    size_t length_xor;
+};
+
+// Reads the fields of a FEC message, whose AudioSequence is @sequence.
+ParityInfo decode_parity(const AudioSequence &sequence);
+
+#endif //DUZE_FEC_H
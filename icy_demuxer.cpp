@@ -0,0 +1,28 @@
+#include "icy_demuxer.h"
+
+namespace {
+    // Length byte and at most 255 * 16 bytes of metadata.
+    const size_t max_metadata_size = 1 + 255 * 16;
+}
+
+IcyDemuxer::IcyDemuxer(int metaint, bool metadata, bool partial_audio)
+    : ring(2 * (metaint + max_metadata_size)), metaint(metaint), metadata(metadata),
+      partial_audio(partial_audio), metadata_now(false), pending(0), audio_done(0) {}
+
+size_t IcyDemuxer::audio_to_come() const {
+    if (!partial_audio || metadata_now || ring.size() > 0)
+        return 0;
+    return metaint - audio_done;
+}
+
+size_t IcyDemuxer::metadata_to_come() const {
+    if (!metadata_now)
+        return ring.free_space();
+    if (ring.size() == 0)
+        return 1;
+    return 1 + 16 * ring.byte_at(0) - ring.size();
+}
+
+void IcyDemuxer::skip_audio(size_t bytes) {
+    audio_passed(bytes);
+}
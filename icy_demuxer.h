@@ -0,0 +1,107 @@
+#ifndef DUZE_ICY_DEMUXER_H
+#define DUZE_ICY_DEMUXER_H
+
+#include <cstdint>
+
+#include "network.h"
+#include "ring_buffer.h"
+
+// A piece of the ICY stream: either metaint bytes of audio or a metadata block.
+// A metadata block starts with its length byte, exactly as it came from the server.
+struct IcyBlock {
+    uint16_t type;
+    RingSpan data;
+};
+
+// Splits an ICY stream into audio and metadata blocks.
+// The stream is kept in a fixed-capacity ring buffer, which is always big enough
+// to hold a full audio block and the longest possible metadata block.
+// With @partial_audio, audio is handed out as soon as any of it is buffered, and
+// the caller may move audio from the stream past the buffer, so only metadata has to
+// go through it.
+class IcyDemuxer {
+public:
+    IcyDemuxer(int metaint, bool metadata, bool partial_audio = false);
+
+    // The buffer to read the stream into.
+    RingBuffer &buffer() {
+        return ring;
+    }
+
+    // Finds the next complete block, saving it to @block.
+    // The view stays valid until the following call to next().
+    // Returns false if more data is needed.
+    bool next(IcyBlock &block) {
+        return metadata ? next<true>(block) : next<false>(block);
+    }
+
+    // Works like next(), for a demuxer whose metadata mode is known to be @Metadata,
+    // so without metadata the metadata state is never looked at.
+    template <bool Metadata>
+    bool next(IcyBlock &block);
+
+    // After next() returned false, tells how many bytes of the current audio block
+    // may be taken from the stream past the buffer. Returns 0 if metadata comes first.
+    size_t audio_to_come() const;
+
+    // After next() returned false, tells how many bytes of the stream may be read into
+    // the buffer without reading past the current metadata block.
+    size_t metadata_to_come() const;
+
+    // Records that @bytes of the current audio block were taken past the buffer.
+    void skip_audio(size_t bytes);
+
+private:
+    // Records that @bytes of the current audio block were handed out.
+    void audio_passed(size_t bytes) {
+        audio_done += bytes;
+        if (audio_done == metaint) {
+            audio_done = 0;
+            metadata_now = metadata;
+        }
+    }
+
+    RingBuffer ring;
+    size_t metaint;
+    bool metadata;
+    bool partial_audio;
+    bool metadata_now;
+    size_t pending;
+    // Bytes of the current audio block already handed out.
+    size_t audio_done;
+};
+
+template <bool Metadata>
+bool IcyDemuxer::next(IcyBlock &block) {
+    ring.consume(pending);
+    pending = 0;
+
+    if (Metadata && metadata_now) {
+        if (ring.size() == 0)
+            return false;
+
+        size_t length = 1 + 16 * ring.byte_at(0);
+        if (ring.size() < length)
+            return false;
+
+        block.type = METADATA;
+        block.data = ring.peek(0, length);
+        pending = length;
+        metadata_now = false;
+        return true;
+    }
+
+    size_t length = metaint - audio_done;
+    if (partial_audio && ring.size() < length)
+        length = ring.size();
+    if (length == 0 || ring.size() < length)
+        return false;
+
+    block.type = AUDIO;
+    block.data = ring.peek(0, length);
+    pending = length;
+    audio_passed(length);
+    return true;
+}
+
+#endif //DUZE_ICY_DEMUXER_H
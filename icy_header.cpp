@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "err.h"
+#include "icy_header.h"
+
+using namespace std;
+
+namespace {
+    // Longest header line accepted, so that a broken server cannot make the line grow forever.
+    const size_t max_line = 8192;
+
+    // Checks if @line starts with @prefix, ignoring case.
+    bool starts_with(const string &line, const char *prefix) {
+        size_t size = strlen(prefix);
+        return line.size() >= size && strncasecmp(line.c_str(), prefix, size) == 0;
+    }
+}
+
+IcyHeaderParser::IcyHeaderParser()
+    : state(STATUS_LINE), ok(false), metaint_seen(false), metaint_value(0), name_seen(false) {}
+
+size_t IcyHeaderParser::feed(const char *data, size_t size) {
+    size_t used = 0;
+    while (used < size && state != DONE) {
+        const char *end = (const char *)memchr(data + used, '\n', size - used);
+        size_t length = end ? end - (data + used) : size - used;
+
+        if (line.size() + length > max_line)
+            fatal("Header line too long");
+        line.append(data + used, length);
+        used += length;
+
+        if (end) {
+            used++;
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            line_done();
+            line.clear();
+        }
+    }
+    return used;
+}
+
+void IcyHeaderParser::line_done() {
+    if (state == STATUS_LINE) {
+        ok = starts_with(line, "ICY 200 OK") || starts_with(line, "HTTP/1.0 200 OK") ||
+             starts_with(line, "HTTP/1.1 200 OK");
+        state = FIELD_LINE;
+    } else if (line.empty()) {
+        state = DONE;
+    } else if (starts_with(line, "icy-metaint:")) {
+        metaint_seen = true;
+        metaint_value = atoi(line.c_str() + strlen("icy-metaint:"));
+    } else if (starts_with(line, "icy-name:")) {
+        // Names have always been relayed in upper case.
+        name_seen = true;
+        name_value = line.substr(strlen("icy-name:"));
+        transform(name_value.begin(), name_value.end(), name_value.begin(), ::toupper);
+    }
+}
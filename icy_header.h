@@ -0,0 +1,61 @@
+#ifndef DUZE_ICY_HEADER_H
+#define DUZE_ICY_HEADER_H
+
+#include <cstddef>
+#include <string>
+
+// Incremental parser of the response header of an ICY or HTTP server.
+// Bytes are fed as they come, in pieces split anywhere, and every byte is
+// looked at once. Only the current line is kept, and fields are recognised
+// as soon as their line ends.
+class IcyHeaderParser {
+public:
+    IcyHeaderParser();
+
+    // Parses the next @size bytes. Returns how many of them belong to the header,
+    // the remaining ones are the beginning of the stream.
+    size_t feed(const char *data, size_t size);
+
+    // Whether the empty line ending the header was seen.
+    bool done() const {
+        return state == DONE;
+    }
+
+    // Whether the status line said 200 OK.
+    bool status_ok() const {
+        return ok;
+    }
+
+    bool has_metaint() const {
+        return metaint_seen;
+    }
+
+    int metaint() const {
+        return metaint_value;
+    }
+
+    bool has_name() const {
+        return name_seen;
+    }
+
+    const std::string &name() const {
+        return name_value;
+    }
+
+private:
+    enum State { STATUS_LINE, FIELD_LINE, DONE };
+
+    // Handles a complete line, without its line ending.
+    void line_done();
+
+    State state;
+    std::string line;
+
+    bool ok;
+    bool metaint_seen;
+    int metaint_value;
+    bool name_seen;
+    std::string name_value;
+};
+
+#endif //DUZE_ICY_HEADER_H
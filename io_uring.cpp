@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "io_uring.h"
+
+using namespace std;
+
+namespace {
+    int io_uring_setup(unsigned entries, io_uring_params *params) {
+        return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    // Maps a part of the ring shared with the kernel.
+    void *map_ring(int fd, size_t size, off_t offset) {
+        void *ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (ring == MAP_FAILED)
+            syserr("mmap");
+        return ring;
+    }
+
+    unsigned *field(void *ring, uint32_t offset) {
+        return (unsigned *)((char *)ring + offset);
+    }
+}
+
+IoUring::IoUring()
+    : ring_fd(-1), eventfd(-1), sq_ring(nullptr), sq_ring_size(0), sqes(nullptr), sqes_size(0),
+      queued(0), cq_ring(nullptr), cq_ring_size(0), buf_ring(nullptr), buf_ring_size(0),
+      buf_mask(0), buf_tail(0), buffer_size(0) {}
+
+unique_ptr<IoUring> IoUring::open(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int fd = io_uring_setup(entries, &params);
+    if (fd < 0) {
+        if (errno == ENOSYS || errno == EPERM || errno == EINVAL)
+            return nullptr;
+        syserr("io_uring_setup");
+    }
+
+    unique_ptr<IoUring> ring(new IoUring());
+    ring->ring_fd = fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // Older kernels map the two rings separately.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+        ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+        ring->cq_ring = map_ring(fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *)map_ring(fd, ring->sqes_size, IORING_OFF_SQES);
+
+    ring->sq_head = field(ring->sq_ring, params.sq_off.head);
+    ring->sq_tail = field(ring->sq_ring, params.sq_off.tail);
+    ring->sq_mask = *field(ring->sq_ring, params.sq_off.ring_mask);
+    ring->sq_array = field(ring->sq_ring, params.sq_off.array);
+    ring->cq_head = field(ring->cq_ring, params.cq_off.head);
+    ring->cq_tail = field(ring->cq_ring, params.cq_off.tail);
+    ring->cq_mask = *field(ring->cq_ring, params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    ring->eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->eventfd < 0)
+        syserr("eventfd");
+    if (io_uring_register(fd, IORING_REGISTER_EVENTFD, &ring->eventfd, 1) < 0)
+        syserr("io_uring_register eventfd");
+    return ring;
+}
+
+IoUring::~IoUring() {
+    if (buf_ring)
+        munmap(buf_ring, buf_ring_size);
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(eventfd);
+    close(ring_fd);
+}
+
+io_uring_sqe *IoUring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail + queued;
+    if (tail - head > sq_mask)
+        return nullptr;
+
+    unsigned index = tail & sq_mask;
+    sq_array[index] = index;
+    queued++;
+    memset(&sqes[index], 0, sizeof sqes[index]);
+    return &sqes[index];
+}
+
+void IoUring::submit(unsigned wait_for) {
+    unsigned to_submit = queued;
+    __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (io_uring_enter(ring_fd, to_submit, wait_for, flags) < 0) {
+        if (errno != EINTR)
+            syserr("io_uring_enter");
+        // Requests were taken before the signal came.
+        to_submit = 0;
+    }
+}
+
+bool IoUring::pop_cqe(io_uring_cqe &cqe) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool IoUring::provide_buffers(uint16_t group, unsigned count, size_t size) {
+    buf_ring_size = count * sizeof(io_uring_buf);
+    void *memory = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        syserr("mmap");
+    buf_ring = (io_uring_buf *)memory;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(buf_ring, buf_ring_size);
+        buf_ring = nullptr;
+        return false;
+    }
+
+    buf_mask = count - 1;
+    buffer_size = size;
+    buffers.reset(new char[count * size]);
+    for (unsigned id = 0; id < count; id++)
+        recycle_buffer(id);
+    return true;
+}
+
+void IoUring::recycle_buffer(uint16_t id) {
+    io_uring_buf &buf = buf_ring[buf_tail & buf_mask];
+    buf.addr = (uint64_t)(buffers.get() + id * buffer_size);
+    buf.len = buffer_size;
+    buf.bid = id;
+    buf_tail++;
+    __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,86 @@
+#ifndef DUZE_IO_URING_H
+#define DUZE_IO_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <memory>
+
+// A minimal io_uring instance, set up with raw system calls.
+// Submission and completion queues are shared with the kernel through mmap,
+// so queueing requests and reaping completions costs no system calls, and a
+// whole batch of requests is handed to the kernel with a single io_uring_enter.
+// An eventfd signals posted completions, so the ring can be driven by a Reactor.
+// A ring is used by one thread only.
+class IoUring {
+public:
+    // Sets up a ring with room for @entries requests.
+    // Returns null if the kernel does not provide io_uring or forbids it.
+    static std::unique_ptr<IoUring> open(unsigned entries);
+
+    ~IoUring();
+
+    // Returns a cleared request slot, or null if all slots wait for submission.
+    io_uring_sqe *get_sqe();
+
+    // Hands queued requests to the kernel and waits for @wait_for completions.
+    void submit(unsigned wait_for = 0);
+
+    // Takes the oldest completion out. Returns false if there is none.
+    bool pop_cqe(io_uring_cqe &cqe);
+
+    // Becomes readable when completions are posted.
+    int event_fd() const {
+        return eventfd;
+    }
+
+    // Gives the kernel @count buffers of @size bytes as buffer group @group,
+    // for receives that pick their buffer when data comes. @count must be a power of two.
+    // Only one group is supported.
+    // Returns false if the kernel does not support buffer rings.
+    bool provide_buffers(uint16_t group, unsigned count, size_t size);
+
+    // Data of the provided buffer @id.
+    const char *provided_buffer(uint16_t id) const {
+        return buffers.get() + id * buffer_size;
+    }
+
+    // Gives a provided buffer back to the kernel once its data was used.
+    void recycle_buffer(uint16_t id);
+
+private:
+    IoUring();
+
+    int ring_fd;
+    int eventfd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+    // Requests queued since the last submit.
+    unsigned queued;
+
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    // Entries of the buffer ring. The ring's tail overlays the reserved field of
+    // the first entry. It is not reached through io_uring_buf_ring, as C++ lays
+    // out the flexible array of that structure at another offset than C.
+    io_uring_buf *buf_ring;
+    size_t buf_ring_size;
+    unsigned buf_mask;
+    uint16_t buf_tail;
+    std::unique_ptr<char[]> buffers;
+    size_t buffer_size;
+};
+
+#endif //DUZE_IO_URING_H
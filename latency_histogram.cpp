@@ -0,0 +1,66 @@
+#include "latency_histogram.h"
+
+using namespace std;
+
+namespace {
+    // Adds @value to a counter written only by the calling thread.
+    void add_relaxed(atomic<unsigned long long> &counter, unsigned long long value) {
+        counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+    }
+}
+
+LatencyHistogram::LatencyHistogram() : total(0), largest(0) {
+    for (int i = 0; i < buckets; i++)
+        counts[i].store(0, memory_order_relaxed);
+}
+
+void LatencyHistogram::record(long long usec) {
+    unsigned long long value = usec < 0 ? 0 : usec;
+    if (value >= 1ull << max_bits)
+        value = (1ull << max_bits) - 1;
+
+    int bucket;
+    if (value < (unsigned long long)sub_buckets) {
+        bucket = value;
+    } else {
+        int top_bit = 63 - __builtin_clzll(value);
+        int shift = top_bit - sub_bits;
+        bucket = (shift + 1) * sub_buckets + (int)(value >> shift) - sub_buckets;
+    }
+
+    add_relaxed(counts[bucket], 1);
+    add_relaxed(total, 1);
+    if ((long long)value > largest.load(memory_order_relaxed))
+        largest.store(value, memory_order_relaxed);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (int i = 0; i < buckets; i++)
+        add_relaxed(counts[i], other.counts[i].load(memory_order_relaxed));
+    add_relaxed(total, other.count());
+    if (other.max() > max())
+        largest.store(other.max(), memory_order_relaxed);
+}
+
+long long LatencyHistogram::percentile(double quantile) const {
+    unsigned long long all = count();
+    unsigned long long seen = 0, wanted = quantile * all;
+    for (int i = 0; i < buckets; i++) {
+        seen += counts[i].load(memory_order_relaxed);
+        if (seen > wanted || (seen >= all && seen > 0)) {
+            if (i < sub_buckets)
+                return i;
+            // The highest value falling into bucket @i.
+            int shift = i / sub_buckets - 1;
+            long long highest = ((long long)(i % sub_buckets + sub_buckets + 1) << shift) - 1;
+            return highest < max() ? highest : max();
+        }
+    }
+    return 0;
+}
+
+string latency_summary(const LatencyHistogram &histogram) {
+    return to_string(histogram.count()) + " samples, p50 " + to_string(histogram.percentile(0.5)) +
+           ", p99 " + to_string(histogram.percentile(0.99)) + ", p999 " +
+           to_string(histogram.percentile(0.999)) + ", max " + to_string(histogram.max()) + " usec";
+}
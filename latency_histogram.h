@@ -0,0 +1,47 @@
+#ifndef DUZE_LATENCY_HISTOGRAM_H
+#define DUZE_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <string>
+
+// Histogram of latencies in microseconds with logarithmic buckets, like HdrHistogram.
+// Every power of two is split into 16 buckets, so a reported value is within
+// about 6% of the recorded one, and the whole range up to hours fits in a few
+// hundred counters. Only one thread may record, but any thread may read,
+// as counters are atomics updated without read-modify-write instructions.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    // Records a single latency. Negative values count as 0.
+    void record(long long usec);
+
+    // Adds the counts of @other to this histogram, which must not be recorded to meanwhile.
+    void merge(const LatencyHistogram &other);
+
+    unsigned long long count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    long long max() const {
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    // Returns the smallest value not exceeded by a fraction @quantile of the latencies.
+    long long percentile(double quantile) const;
+
+private:
+    static const int sub_bits = 4;
+    static const int sub_buckets = 1 << sub_bits;
+    static const int max_bits = 36;
+    static const int buckets = (max_bits - sub_bits + 2) * sub_buckets;
+
+    std::atomic<unsigned long long> counts[buckets];
+    std::atomic<unsigned long long> total;
+    std::atomic<long long> largest;
+};
+
+// Describes the percentiles of a histogram in one line.
+std::string latency_summary(const LatencyHistogram &histogram);
+
+#endif //DUZE_LATENCY_HISTOGRAM_H
@@ -0,0 +1,134 @@
+#include <cstdlib>
+
+#include "live_stats.h"
+
+using namespace std;
+
+namespace {
+    // Name of the line which ends every report.
+    const string last_report_line = "latency_max_usec";
+
+    // Adds the totals of @totals to @sum.
+    void add_totals(StatsTotals &sum, const StatsTotals &totals) {
+        sum.upstream_bytes += totals.upstream_bytes;
+        sum.blocks += totals.blocks;
+        sum.clients += totals.clients;
+        sum.datagrams += totals.datagrams;
+        sum.syscalls += totals.syscalls;
+        sum.expirations += totals.expirations;
+        sum.pacing_dropped += totals.pacing_dropped;
+        sum.pacing_queued += totals.pacing_queued;
+        sum.send_dropped += totals.send_dropped;
+        sum.send_queued += totals.send_queued;
+        sum.upstream_switches += totals.upstream_switches;
+        sum.upstream_reconnects += totals.upstream_reconnects;
+        sum.upstream_reconnects_failed += totals.upstream_reconnects_failed;
+        sum.upstream_switch_usec += totals.upstream_switch_usec;
+        sum.relay_level += totals.relay_level;
+        sum.relay_hop_rtt_usec += totals.relay_hop_rtt_usec;
+        sum.relay_path_latency_usec += totals.relay_path_latency_usec;
+        sum.relay_lost_datagrams += totals.relay_lost_datagrams;
+        sum.relay_dropped_blocks += totals.relay_dropped_blocks;
+        sum.relay_recovered += totals.relay_recovered;
+    }
+
+    // Per second rate of growth of a counter from @before to @after over @usec microseconds.
+    double rate(unsigned long long before, unsigned long long after, long long usec) {
+        return usec > 0 ? (after - before) * 1000000.0 / usec : 0;
+    }
+}
+
+bool parse_report_line(const string &line, string &name, long long &value) {
+    size_t colon = line.find(": ");
+    if (colon == string::npos || colon + 2 == line.size())
+        return false;
+    char *end;
+    value = strtoll(line.c_str() + colon + 2, &end, 10);
+    if (*end != '\0')
+        return false;
+    name = line.substr(0, colon);
+    return true;
+}
+
+bool report_complete(const string &report) {
+    if (report.empty() || report.back() != '\n')
+        return false;
+    size_t start = report.rfind('\n', report.size() - 2);
+    start = start == string::npos ? 0 : start + 1;
+    string name;
+    long long value;
+    return parse_report_line(report.substr(start, report.size() - 1 - start), name, value)
+           && name == last_report_line;
+}
+
+LiveStats::LiveStats(size_t parts, long long now)
+    : previous(parts, Sample{StatsTotals(), now}), current(parts, Sample{StatsTotals(), now}),
+      started(now), last_package(now) {
+    for (size_t i = 0; i < parts; i++)
+        latencies.emplace_back(new LatencyHistogram());
+}
+
+void LiveStats::total_latency(LatencyHistogram &result) const {
+    for (auto &histogram : latencies)
+        result.merge(*histogram);
+}
+
+void LiveStats::update(size_t part, const StatsTotals &totals, long long now) {
+    lock_guard<mutex> guard(lock);
+    previous[part] = current[part];
+    current[part] = Sample{totals, now};
+}
+
+string LiveStats::report(long long now) {
+    StatsTotals sum = StatsTotals();
+    double bytes_rate = 0, blocks_rate = 0, datagrams_rate = 0, syscalls_rate = 0;
+    {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < current.size(); i++) {
+            const StatsTotals &before = previous[i].totals, &after = current[i].totals;
+            long long usec = current[i].time - previous[i].time;
+            add_totals(sum, after);
+            bytes_rate += rate(before.upstream_bytes, after.upstream_bytes, usec);
+            blocks_rate += rate(before.blocks, after.blocks, usec);
+            datagrams_rate += rate(before.datagrams, after.datagrams, usec);
+            syscalls_rate += rate(before.syscalls, after.syscalls, usec);
+        }
+    }
+
+    LatencyHistogram latency;
+    total_latency(latency);
+
+    string result;
+    result += "uptime_sec: " + to_string((now - started) / 1000000) + "\n";
+    result += "upstream_bytes: " + to_string(sum.upstream_bytes) + "\n";
+    result += "upstream_bytes_per_sec: " + to_string((long long)bytes_rate) + "\n";
+    result += "blocks: " + to_string(sum.blocks) + "\n";
+    result += "blocks_per_sec: " + to_string((long long)blocks_rate) + "\n";
+    result += "clients: " + to_string(sum.clients) + "\n";
+    result += "datagrams: " + to_string(sum.datagrams) + "\n";
+    result += "datagrams_per_sec: " + to_string((long long)datagrams_rate) + "\n";
+    result += "syscalls: " + to_string(sum.syscalls) + "\n";
+    result += "syscalls_per_sec: " + to_string((long long)syscalls_rate) + "\n";
+    result += "expirations: " + to_string(sum.expirations) + "\n";
+    result += "pacing_dropped: " + to_string(sum.pacing_dropped) + "\n";
+    result += "pacing_queued_blocks: " + to_string(sum.pacing_queued) + "\n";
+    result += "send_dropped: " + to_string(sum.send_dropped) + "\n";
+    result += "send_queued_blocks: " + to_string(sum.send_queued) + "\n";
+    result += "upstream_switches: " + to_string(sum.upstream_switches) + "\n";
+    result += "upstream_reconnects: " + to_string(sum.upstream_reconnects) + "\n";
+    result += "upstream_reconnects_failed: " + to_string(sum.upstream_reconnects_failed) + "\n";
+    result += "upstream_last_switch_usec: " + to_string(sum.upstream_switch_usec) + "\n";
+    result += "relay_level: " + to_string(sum.relay_level) + "\n";
+    result += "relay_hop_rtt_usec: " + to_string(sum.relay_hop_rtt_usec) + "\n";
+    result += "relay_path_latency_usec: " + to_string(sum.relay_path_latency_usec) + "\n";
+    result += "relay_lost_datagrams: " + to_string(sum.relay_lost_datagrams) + "\n";
+    result += "relay_dropped_blocks: " + to_string(sum.relay_dropped_blocks) + "\n";
+    result += "relay_recovered: " + to_string(sum.relay_recovered) + "\n";
+    result += "last_package_age_ms: " + to_string((now - last_package.load(memory_order_relaxed)) / 1000) + "\n";
+    result += "latency_samples: " + to_string(latency.count()) + "\n";
+    result += "latency_p50_usec: " + to_string(latency.percentile(0.5)) + "\n";
+    result += "latency_p99_usec: " + to_string(latency.percentile(0.99)) + "\n";
+    result += "latency_p999_usec: " + to_string(latency.percentile(0.999)) + "\n";
+    result += last_report_line + ": " + to_string(latency.max()) + "\n";
+    return result;
+}
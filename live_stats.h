@@ -0,0 +1,91 @@
+#ifndef DUZE_LIVE_STATS_H
+#define DUZE_LIVE_STATS_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+
+// Totals of one part of the proxy since it started.
+struct StatsTotals {
+    unsigned long long upstream_bytes;
+    unsigned long long blocks;
+    unsigned long long clients;
+    unsigned long long datagrams;
+    unsigned long long syscalls;
+    unsigned long long expirations;
+    unsigned long long pacing_dropped;
+    unsigned long long pacing_queued;
+    unsigned long long send_dropped;
+    unsigned long long send_queued;
+    // Upstream connections replaced by another one, and connections opened to do it.
+    unsigned long long upstream_switches;
+    unsigned long long upstream_reconnects;
+    unsigned long long upstream_reconnects_failed;
+    // Time from losing a connection to relaying from its replacement, for the last switch.
+    unsigned long long upstream_switch_usec;
+    // Depth in a tree of proxies, 0 for a proxy reading from servers.
+    unsigned long long relay_level;
+    // Hop from the parent proxy: round trip of its last STATS reply, and estimated
+    // time from the root proxy receiving a block to this one receiving it.
+    unsigned long long relay_hop_rtt_usec;
+    unsigned long long relay_path_latency_usec;
+    // Losses on the hop from the parent proxy.
+    unsigned long long relay_lost_datagrams;
+    unsigned long long relay_dropped_blocks;
+    unsigned long long relay_recovered;
+};
+
+// Reads a "name: value" line of a report. Returns false if @line is not one.
+bool parse_report_line(const std::string &line, std::string &name, long long &value);
+
+// Checks if @report, which may come in many datagrams, got to its last line.
+bool report_complete(const std::string &report);
+
+// Numbers of a running proxy, reported in reply to STATS requests.
+// Every thread of the proxy is a part, which publishes its own totals about
+// once a second, so that the hot paths keep plain counters. Rates are computed
+// from the last two updates of every part. Any thread may build a report.
+
+class LiveStats {
+public:
+    LiveStats(size_t parts, long long now);
+
+    // Replaces the totals of part @part.
+    void update(size_t part, const StatsTotals &totals, long long now);
+
+    // Notes that an upstream package came at @now. Called for every package.
+    void package_received(long long now) {
+        last_package.store(now, std::memory_order_relaxed);
+    }
+
+    // Latencies from receiving a block from upstream to sending it to the last client,
+    // recorded only by the thread of part @part.
+    LatencyHistogram &latency(size_t part) {
+        return *latencies[part];
+    }
+
+    // Latencies of all parts together.
+    void total_latency(LatencyHistogram &result) const;
+
+    // Formats the numbers as lines of "name: value".
+    std::string report(long long now);
+
+private:
+    struct Sample {
+        StatsTotals totals;
+        long long time;
+    };
+
+    std::mutex lock;
+    std::vector<Sample> previous;
+    std::vector<Sample> current;
+    std::vector<std::unique_ptr<LatencyHistogram>> latencies;
+    long long started;
+    std::atomic<long long> last_package;
+};
+
+#endif //DUZE_LIVE_STATS_H
@@ -1,9 +1,15 @@
+#include <time.h>
+
 #include "my_time.h"
 
 timeval time_now() {
-    timeval current_time;
-    gettimeofday(&current_time, nullptr);
-    return current_time;
+    timespec current_time;
+    clock_gettime(CLOCK_MONOTONIC, &current_time);
+    return timeval{current_time.tv_sec, current_time.tv_nsec / 1000};
+}
+
+long long now_usec() {
+    return to_usec(time_now());
 }
 
 timeval make_duration(int sec, int usec) {
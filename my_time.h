@@ -3,8 +3,13 @@
 
 #include <sys/time.h>
 
+// Returns the current time of the monotonic clock, which is not affected
+// by changes of the system time.
 timeval time_now();
 
+// Returns the current time of the monotonic clock in microseconds.
+long long now_usec();
+
 // Converts given time to microseconds.
 long long to_usec(timeval t);
 
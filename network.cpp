@@ -1,18 +1,84 @@
 #include <arpa/inet.h>
+#include <atomic>
 #include <cstring>
+#include <netinet/udp.h>
 #include <errno.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 
 #include "err.h"
+#include "io_uring.h"
+#include "my_time.h"
 #include "network.h"
 
 using namespace std;
 
 namespace {
     const int BUFFER_SIZE = 2000;
+    const int MAX_BATCH = 512;
+    // Limits of a single GSO send, kept below those of the kernel.
+    const size_t MAX_GSO_SEGMENTS = 64;
+    const size_t MAX_GSO_BYTES = 65000;
+    // A GSO segment has to fit the path MTU whole, as the kernel refuses to fragment it.
+    // Paths are not known in advance, so segments are kept within common Ethernet MTUs.
+    const size_t GSO_PATH_MTU = 1500;
+    const size_t IP_UDP_HEADERS = 28;
 
-    // defined globally, to not allocate it in each call of a function
-    char buffer[BUFFER_SIZE + 5];
+    size_t max_payload = DEFAULT_MAX_PAYLOAD;
+    // Switched off by any thread whose GSO send is refused.
+    atomic<bool> gso(false);
+
+    // Encoded fragments of the message currently sent by udp_write_to_all.
+    // Each fragment takes 3 iovecs: a header and up to two parts of the payload.
+    thread_local vector<char> fragment_headers;
+    thread_local vector<iovec> fragment_iovs;
+    thread_local vector<int> fragment_iov_counts;
+    thread_local mmsghdr batch[MAX_BATCH];
+    // Where every message of the batch starts, and how many datagrams it carries.
+    thread_local FanoutPosition batch_positions[MAX_BATCH];
+    thread_local size_t batch_segments[MAX_BATCH];
+    // Results of the sends of a batch queued to the fan-out ring.
+    thread_local int ring_results[MAX_BATCH];
+
+    // With GSO, runs of fragments sent as one message, with their iovecs next to each other.
+    struct GsoGroup {
+        size_t first_iov;
+        size_t iov_count;
+        size_t first_fragment;
+        size_t segments;
+    };
+    thread_local vector<iovec> gso_iovs;
+    thread_local vector<GsoGroup> gso_groups;
+    // Control message with the segment size, shared by all messages of a send.
+    thread_local union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        cmsghdr align;
+    } gso_control;
+
+    // Ring taking the batches of this thread, if any.
+    thread_local IoUring *fanout_ring = nullptr;
+}
+
+void set_fanout_ring(IoUring *ring) {
+    fanout_ring = ring;
+}
+
+void set_max_payload(size_t payload) {
+    max_payload = payload;
+}
+
+bool enable_gso() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        syserr("socket");
+    int segment = max_payload + 4;
+    gso = segment + IP_UDP_HEADERS <= GSO_PATH_MTU
+          && setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof segment) == 0;
+    close(sock);
+    return gso;
 }
 
 void make_header(uint16_t type, uint16_t length, char *buf) {
@@ -31,111 +97,453 @@ void decode_header(char *buf, uint16_t &type, uint16_t &length) {
     length = ntohs(length);
 }
 
+void encode_sequence(const AudioSequence &sequence, char *buf) {
+    uint32_t words[3] = {htonl(sequence.datagram), htonl(sequence.block), htonl(sequence.timestamp)};
+    uint16_t halves[2] = {htons(sequence.fragment), htons(sequence.fragments)};
+    memcpy(buf, words, 12);
+    memcpy(buf + 12, halves, 4);
+}
+
+bool decode_sequence(const RingSpan &message, AudioSequence &sequence) {
+    if (message.size() < SEQUENCE_SIZE)
+        return false;
+    uint32_t words[3];
+    uint16_t halves[2];
+    message.copy(0, 12, (char *)words);
+    message.copy(12, 4, (char *)halves);
+    sequence.datagram = ntohl(words[0]);
+    sequence.block = ntohl(words[1]);
+    sequence.timestamp = ntohl(words[2]);
+    sequence.fragment = ntohs(halves[0]);
+    sequence.fragments = ntohs(halves[1]);
+    return true;
+}
+
+string encode_group(const sockaddr_in &group) {
+    string message(6, '\0');
+    memcpy(&message[0], &group.sin_addr.s_addr, 4);
+    memcpy(&message[4], &group.sin_port, 2);
+    return message;
+}
+
+bool decode_group(const RingSpan &message, sockaddr_in &group) {
+    if (message.size() != 6)
+        return false;
+    memset(&group, 0, sizeof group);
+    group.sin_family = AF_INET;
+    message.copy(0, 4, (char *)&group.sin_addr.s_addr);
+    message.copy(4, 2, (char *)&group.sin_port);
+    return IN_MULTICAST(ntohl(group.sin_addr.s_addr));
+}
+
+string encode_capabilities(uint32_t capabilities) {
+    capabilities = htonl(capabilities);
+    return string((const char *)&capabilities, 4);
+}
+
+uint32_t decode_capabilities(const RingSpan &message) {
+    uint32_t capabilities = 0;
+    if (message.size() >= 4)
+        message.copy(0, 4, (char *)&capabilities);
+    return ntohl(capabilities);
+}
+
+// Checks if the last failed send was refused for the moment or for a single
+// recipient, rather than because of a broken socket.
+bool send_failed_softly() {
+    return errno != EBADF && errno != EFAULT && errno != ENOTSOCK && errno != EINVAL;
+}
+
 ssize_t tcp_read(int sock, string &result) {
-    int rcv_len = read(sock, buffer, BUFFER_SIZE);
+    char buf[BUFFER_SIZE];
+    int rcv_len = read(sock, buf, BUFFER_SIZE);
     if (rcv_len > 0) {
-        result.assign(buffer, rcv_len);
+        result.assign(buf, rcv_len);
     }
     return rcv_len;
 }
 
-void tcp_write(int socket, string message) {
+void tcp_write(int socket, const string &message) {
     if (write(socket, message.c_str(), message.size()) != (ssize_t)message.size()) {
         syserr("partial / failed write");
     }
 }
 
-ssize_t udp_single_read(int socket, sockaddr_in *address) {
-    if (address) {
-        socklen_t salen = sizeof(*address);
-        return recvfrom(socket, buffer, BUFFER_SIZE, 0, (sockaddr *) address,
-                        &salen);
-    } else {
-        return read(socket, buffer, BUFFER_SIZE);
-    }
-}
+ssize_t udp_receive(int socket, char *buf, size_t size, sockaddr_in *address, Datagram &datagram) {
+    datagram = Datagram();
+    char header[4];
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = size;
+    char control[CMSG_SPACE(sizeof(in_pktinfo))];
 
-void udp_single_write(int socket, const char *buf, ssize_t size, sockaddr_in *address) {
-    if (address) {
-        if (sendto(socket, buf, size, 0, (const sockaddr *) address,
-                sizeof *address) != size)
-            syserr("write");
-    } else {
-        if (write(socket, buf, size) != size) {
-            syserr("write");
-        }
-    }
-}
+    msghdr msg = {};
+    msg.msg_name = address;
+    msg.msg_namelen = address ? sizeof *address : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
 
-ssize_t udp_read(int socket, string &result, sockaddr_in *address, uint16_t &type) {
-    ssize_t rcv_len = udp_single_read(socket, address);
-
-    if (rcv_len < 0) {
+    ssize_t rcv_len = recvmsg(socket, &msg, 0);
+    if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return WOULD_BLOCK;
+    } else if (rcv_len < 0) {
         syserr("read");
     } else if (rcv_len < 4) {
         return -1;
     }
 
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+            in_pktinfo info;
+            memcpy(&info, CMSG_DATA(c), sizeof info);
+            // A datagram sent to this host has the local address as its destination.
+            datagram.group = info.ipi_addr.s_addr != info.ipi_spec_dst.s_addr;
+        }
+    }
+
     uint16_t message_size;
-    decode_header(buffer, type, message_size);
-    result.assign(buffer + 4, rcv_len - 4);
+    decode_header(header, datagram.type, message_size);
+    size_t payload_size = rcv_len - 4;
+    // Every fragment declares its own size, a shorter one has been cut.
+    if (payload_size < message_size)
+        return -1;
+    datagram.payload = RingSpan(buf, payload_size);
+    return payload_size;
+}
 
-    while (result.size() < message_size) {
-        rcv_len = udp_single_read(socket, address);
-        if (rcv_len < 0) {
-            syserr("read");
-        }
-        result += string(buffer, rcv_len);
+ssize_t udp_read(int socket, string &result, sockaddr_in *address, uint16_t &type) {
+    char buf[LIMIT_MAX_PAYLOAD];
+    Datagram datagram;
+    ssize_t rcv_len = udp_receive(socket, buf, sizeof buf, address, datagram);
+    if (rcv_len >= 0) {
+        type = datagram.type;
+        result.assign(buf, rcv_len);
     }
-    return result.size();
+    return rcv_len;
 }
 
-void udp_write(int socket, string message, sockaddr_in *address, uint16_t type) {
-    message = "####" + message;
-    int size_left = message.size() - 4;
-    int current_position = 4;
+size_t udp_write(int socket, const string &message, sockaddr_in *address, uint16_t type) {
+    return udp_write(socket, RingSpan(message.data(), message.size()), address, type);
+}
+
+size_t udp_write(int socket, const RingSpan &message, sockaddr_in *address, uint16_t type) {
+    size_t size_left = message.size();
+    size_t current_position = 0;
+    size_t lost = 0;
     bool need_any_write = true;
+    char header[4];
 
     while (size_left > 0 || need_any_write) {
         need_any_write = false;
-        int to_send_now = min(size_left, BUFFER_SIZE - 4);
+        size_t to_send_now = min(size_left, max_payload);
+        RingSpan fragment = message.sub(current_position, to_send_now);
 
-        make_header(type, to_send_now, (char *)message.c_str() + current_position - 4);
+        make_header(type, to_send_now, header);
 
-        udp_single_write(socket, message.c_str() + current_position - 4, to_send_now + 4, address);
+        iovec iov[3];
+        int iov_count = 1;
+        iov[0].iov_base = header;
+        iov[0].iov_len = 4;
+        for (int i = 0; i < 2; i++) {
+            if (fragment.part_size[i] > 0) {
+                iov[iov_count].iov_base = (void *)fragment.part[i];
+                iov[iov_count].iov_len = fragment.part_size[i];
+                iov_count++;
+            }
+        }
+
+        msghdr msg = {};
+        msg.msg_name = address;
+        msg.msg_namelen = address ? sizeof *address : 0;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        // A datagram the socket has no room for (EAGAIN, ENOBUFS) is lost like any other.
+        if (sendmsg(socket, &msg, 0) < 0) {
+            if (!send_failed_softly())
+                syserr("write");
+            lost++;
+        }
 
         current_position += to_send_now;
         size_left -= to_send_now;
     }
+    return lost;
 }
 
-int custom_select(int &sock1, int &sock2, timeval timeout) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sock1, &readfds);
-    if (sock2 > 0) {
-        FD_SET(sock2, &readfds);
+size_t udp_fragment_payload(bool sequenced) {
+    return max_payload - (sequenced ? SEQUENCE_SIZE : 0);
+}
+
+size_t udp_fragments(size_t size, bool sequenced) {
+    size_t payload = udp_fragment_payload(sequenced);
+    return max((size + payload - 1) / payload, (size_t)1);
+}
+
+// Encodes the fragments of @message, with @sequence if it's not null. Returns their number.
+size_t encode_fragments(const RingSpan &message, uint16_t type, const AudioSequence *sequence) {
+    size_t payload = udp_fragment_payload(sequence != nullptr);
+    size_t header_size = 4 + (sequence ? SEQUENCE_SIZE : 0);
+    size_t fragments = udp_fragments(message.size(), sequence != nullptr);
+    fragment_headers.resize(header_size * fragments);
+    fragment_iovs.resize(3 * fragments);
+    fragment_iov_counts.resize(fragments);
+
+    for (size_t f = 0; f < fragments; f++) {
+        size_t position = f * payload;
+        size_t to_send_now = min(message.size() - position, payload);
+        RingSpan fragment = message.sub(position, to_send_now);
+
+        char *header = fragment_headers.data() + header_size * f;
+        make_header(type, header_size - 4 + to_send_now, header);
+        if (sequence) {
+            AudioSequence numbered = *sequence;
+            numbered.datagram += f;
+            numbered.fragment = f;
+            numbered.fragments = fragments;
+            encode_sequence(numbered, header + 4);
+        }
+
+        iovec *iov = fragment_iovs.data() + 3 * f;
+        int iov_count = 1;
+        iov[0].iov_base = header;
+        iov[0].iov_len = header_size;
+        for (int i = 0; i < 2; i++) {
+            if (fragment.part_size[i] > 0) {
+                iov[iov_count].iov_base = (void *)fragment.part[i];
+                iov[iov_count].iov_len = fragment.part_size[i];
+                iov_count++;
+            }
+        }
+        fragment_iov_counts[f] = iov_count;
     }
+    return fragments;
+}
 
-    int result;
-    if ((result = select(max(sock1, sock2) + 1, &readfds, NULL, NULL, &timeout)) < 0) {
-        if (errno != EINTR)
-            syserr("select");
-        return -1;
+// Groups encoded fragments for GSO. Every group but the last one of a message
+// consists of full fragments only, as the kernel cuts it into equal segments.
+void group_fragments(size_t fragments) {
+    gso_iovs.clear();
+    gso_groups.clear();
+    size_t bytes = 0;
+    for (size_t f = 0; f < fragments; f++) {
+        size_t size = 4 + max_payload;
+        if (gso_groups.empty() || gso_groups.back().segments == MAX_GSO_SEGMENTS ||
+                bytes + size > MAX_GSO_BYTES) {
+            gso_groups.push_back(GsoGroup{gso_iovs.size(), 0, f, 0});
+            bytes = 0;
+        }
+        GsoGroup &group = gso_groups.back();
+        for (int i = 0; i < fragment_iov_counts[f]; i++)
+            gso_iovs.push_back(fragment_iovs[3 * f + i]);
+        group.iov_count += fragment_iov_counts[f];
+        group.segments++;
+        bytes += size;
     }
 
-    if (FD_ISSET(sock1, &readfds)) {
-        sock1 = 1;
-    } else {
-        sock1 = -1;
+    cmsghdr *c = &gso_control.align;
+    c->cmsg_level = SOL_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment = max_payload + 4;
+    memcpy(CMSG_DATA(c), &segment, sizeof segment);
+}
+
+// Sends @count messages of the batch starting from @first through the fan-out ring.
+// The sends are linked, so that they go out in order and the ones following a failed
+// send are cancelled. Returns the number of messages sent before the first failure,
+// or -1 with errno set if the first message failed.
+int ring_send(int socket, int first, int count, FanoutStats &stats) {
+    int sent = 0;
+    while (sent < count) {
+        // Waiting for all sends keeps the batch and the fragments alive
+        // for as long as the kernel uses them.
+        int queued = 0;
+        io_uring_sqe *sqe, *last = nullptr;
+        while (sent + queued < count && (sqe = fanout_ring->get_sqe())) {
+            int i = first + sent + queued;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socket;
+            sqe->addr = (uint64_t)&batch[i].msg_hdr;
+            sqe->len = 1;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = i;
+            last = sqe;
+            queued++;
+        }
+        // Without room in the ring, the rest goes out the plain way.
+        if (queued == 0) {
+            int result = sendmmsg(socket, batch + first + sent, count - sent, 0);
+            stats.syscalls++;
+            if (result < 0)
+                return sent > 0 ? sent : -1;
+            return sent + result;
+        }
+        // The chain ends with the last send submitted together.
+        last->flags = 0;
+        fanout_ring->submit(queued);
+        stats.syscalls++;
+
+        io_uring_cqe cqe;
+        while (fanout_ring->pop_cqe(cqe))
+            ring_results[cqe.user_data] = cqe.res;
+        for (int end = first + sent + queued, i = first + sent; i < end; i++) {
+            if (ring_results[i] < 0) {
+                errno = -ring_results[i];
+                return sent > 0 ? sent : -1;
+            }
+            sent++;
+        }
     }
+    return sent;
+}
+
+// Whether a send of a message cut by GSO failed because the kernel could not cut it,
+// for instance as a segment does not fit the MTU of the route.
+bool gso_refused(int sent) {
+    return batch_segments[sent] > 1 && (errno == EINVAL || errno == EMSGSIZE || errno == EIO);
+}
 
-    if (sock2 > 0 && FD_ISSET(sock2, &readfds)) {
-        sock2 = 1;
-    } else {
-        sock2 = -1;
+// Sends a batch of prepared messages, retrying the part the kernel did not take.
+// A message which cannot reach its recipient is skipped and counted.
+// If a GSO message is refused, switches GSO off and sets @refused.
+// Returns the number of messages sent or skipped before the socket ran out of room
+// or GSO was refused.
+int send_batch(int socket, int size, FanoutStats &stats, bool &refused) {
+    int sent = 0;
+    while (sent < size) {
+        int result;
+        if (fanout_ring) {
+            result = ring_send(socket, sent, size - sent, stats);
+        } else {
+            result = sendmmsg(socket, batch + sent, size - sent, 0);
+            stats.syscalls++;
+        }
+
+        if (result > 0) {
+            for (int i = sent; i < sent + result; i++)
+                stats.datagrams += batch_segments[i];
+            sent += result;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            stats.stalls++;
+            break;
+        } else if (gso_refused(sent)) {
+            gso = false;
+            refused = true;
+            cerr << "UDP GSO refused, sending fragments one by one\n";
+            break;
+        } else if (!send_failed_softly()) {
+            syserr("sendmmsg");
+        } else if (errno != EINTR) {
+            stats.errors += batch_segments[sent];
+            sent++;
+        }
     }
+    return sent;
+}
+
+// Sends fragments of @message to recipients from @start on, like udp_write_to_all.
+// If GSO is refused, saves the place of the first refused message to @start
+// and returns false with @refused set.
+bool send_fragments(int socket, const RingSpan &message, const sockaddr_in *addresses,
+                    size_t count, uint16_t type, FanoutStats &stats,
+                    const AudioSequence *sequence, FanoutPosition &start, bool &refused) {
+    size_t fragments = encode_fragments(message, type, sequence);
+    // GSO needs checksum offload, which devices carrying multicast often lack.
+    bool multicast = count == 1 && IN_MULTICAST(ntohl(addresses[0].sin_addr.s_addr));
+    bool use_gso = gso && fragments > 1 && !multicast;
+    if (use_gso)
+        group_fragments(fragments);
+
+    // Every recipient gets all fragments in order, either one by one
+    // or in groups cut into datagrams by the kernel.
+    size_t messages = use_gso ? gso_groups.size() : fragments;
+    int size = 0;
+    for (size_t r = start.recipient; r < count; r++) {
+        for (size_t m = 0; m < messages; m++) {
+            size_t first_fragment = use_gso ? gso_groups[m].first_fragment : m;
+            if (r == start.recipient && first_fragment < start.fragment)
+                continue;
+
+            msghdr &msg = batch[size].msg_hdr;
+            msg = msghdr();
+            msg.msg_name = (void *)(addresses + r);
+            msg.msg_namelen = sizeof *addresses;
+            if (use_gso) {
+                const GsoGroup &group = gso_groups[m];
+                msg.msg_iov = gso_iovs.data() + group.first_iov;
+                msg.msg_iovlen = group.iov_count;
+                if (group.segments > 1) {
+                    msg.msg_control = gso_control.buf;
+                    msg.msg_controllen = sizeof gso_control.buf;
+                }
+                batch_segments[size] = group.segments;
+            } else {
+                msg.msg_iov = fragment_iovs.data() + 3 * m;
+                msg.msg_iovlen = fragment_iov_counts[m];
+                batch_segments[size] = 1;
+            }
+            batch_positions[size] = FanoutPosition{r, first_fragment};
+
+            // The batch goes out when it is full or when the message is over.
+            bool last = r + 1 == count && m + 1 == messages;
+            if (++size == MAX_BATCH || last) {
+                int sent = send_batch(socket, size, stats, refused);
+                if (sent < size) {
+                    start = batch_positions[sent];
+                    return false;
+                }
+                size = 0;
+            }
+        }
+    }
+    start = FanoutPosition();
+    return true;
+}
 
+bool udp_write_to_all(int socket, const RingSpan &message, const sockaddr_in *addresses,
+                      size_t count, uint16_t type, FanoutStats &stats,
+                      const AudioSequence *sequence, FanoutPosition *position) {
+    FanoutPosition start = position ? *position : FanoutPosition();
+    if (start.recipient == 0 && start.fragment == 0)
+        stats.blocks++;
+    if (count == 0)
+        return true;
+
+    bool refused = false;
+    bool done = send_fragments(socket, message, addresses, count, type, stats, sequence, start, refused);
+    // The refused batch goes again, one fragment per datagram.
+    if (refused) {
+        refused = false;
+        done = send_fragments(socket, message, addresses, count, type, stats, sequence, start, refused);
+    }
+    if (position)
+        *position = start;
+    return done;
+}
+
+void print_fanout_stats(const FanoutStats &stats) {
+    unsigned long long blocks = max(stats.blocks, 1ull);
+    cerr << "Fan-out: " << stats.blocks << " blocks, " << stats.datagrams << " datagrams, "
+         << stats.syscalls << " syscalls (" << stats.syscalls / (double)blocks << " per block), "
+         << stats.stalls << " stalls, " << stats.errors << " datagrams failed\n";
+}
+
+int wait_for_input(int sock, timeval timeout) {
+    pollfd fd;
+    fd.fd = sock;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int result = poll(&fd, 1, to_usec(timeout) / 1000 + 1);
+    if (result < 0) {
+        if (errno != EINTR)
+            syserr("poll");
+        return -1;
+    }
     return result;
 }
 
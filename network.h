@@ -1,35 +1,178 @@
 #ifndef DUZE_NETWORK_H
 #define DUZE_NETWORK_H
 
+#include <netinet/in.h>
 #include <string>
 
+#include "ring_buffer.h"
+
 const uint16_t DISCOVER = 1;
 const uint16_t IAM = 2;
 const uint16_t KEEPALIVE = 3;
 const uint16_t AUDIO = 4;
 const uint16_t METADATA = 6;
+const uint16_t STATS = 7;
+// Audio fragment starting with an AudioSequence, sent only to agents asking for it.
+const uint16_t AUDIO_SEQ = 8;
+
+// Parity of a group of AUDIO_SEQ fragments, see fec.h.
+const uint16_t FEC = 9;
+// Multicast group carrying the audio and metadata of a station, sent after IAM
+// to agents announcing CAP_GROUP. Such agents get no audio by unicast.
+const uint16_t GROUP = 10;
+
+// Capabilities of an agent, sent as the payload of its DISCOVER.
+// Agents sending an empty DISCOVER get the original protocol.
+const uint32_t CAP_SEQUENCE = 1;
+// Parity datagrams, taken only together with CAP_SEQUENCE.
+const uint32_t CAP_FEC = 2;
+// Audio from a multicast group, taken only together with CAP_SEQUENCE.
+const uint32_t CAP_GROUP = 4;
+
+// Position of an AUDIO_SEQ fragment in the stream of a station.
+struct AudioSequence {
+    // Number of the datagram, counting AUDIO_SEQ datagrams of the station.
+    uint32_t datagram;
+    // Number of the audio block the fragment belongs to.
+    uint32_t block;
+    // Time the block was received by the proxy, in milliseconds.
+    uint32_t timestamp;
+    uint16_t fragment;
+    uint16_t fragments;
+};
+
+// Size of an encoded AudioSequence.
+const size_t SEQUENCE_SIZE = 16;
+
+// Writes an AudioSequence as SEQUENCE_SIZE bytes at @buf.
+void encode_sequence(const AudioSequence &sequence, char *buf);
+
+// Reads the AudioSequence at the beginning of an AUDIO_SEQ message.
+// Returns false if the message is too short.
+bool decode_sequence(const RingSpan &message, AudioSequence &sequence);
+
+// Encodes a group address and port as the payload of a GROUP message.
+std::string encode_group(const sockaddr_in &group);
+
+// Reads a GROUP message. Returns false if it's malformed.
+bool decode_group(const RingSpan &message, sockaddr_in &group);
+
+// Encodes capabilities as the payload of a DISCOVER.
+std::string encode_capabilities(uint32_t capabilities);
+
+// Reads capabilities from the payload of a DISCOVER. An empty payload means none.
+uint32_t decode_capabilities(const RingSpan &message);
+
+// Largest payload of a datagram by default. With our header, IP and UDP headers,
+// a datagram takes 1428 bytes, which fits into common MTUs with room for tunnels,
+// so it is never fragmented by IP.
+const size_t DEFAULT_MAX_PAYLOAD = 1396;
+// Receivers read datagrams of at most 2000 bytes.
+const size_t LIMIT_MAX_PAYLOAD = 1996;
+// Fragments have to fit the sequence header and some audio.
+const size_t MIN_MAX_PAYLOAD = 64;
+
+// Sets the largest payload of datagrams sent from now on, at most LIMIT_MAX_PAYLOAD.
+// Must be called before other threads start sending.
+void set_max_payload(size_t payload);
+
+// Makes udp_write_to_all send all fragments of a message to a recipient with
+// a single message cut into datagrams by the kernel (UDP GSO), if the kernel
+// supports it and a datagram fits an Ethernet MTU. Returns whether GSO is used.
+// If the kernel refuses a GSO send later on, GSO is switched off for good.
+// Must be called like set_max_payload, and again after it.
+bool enable_gso();
 
 // Performs a TCP read from socket sock, saving the message to @result.
 ssize_t tcp_read(int sock, std::string &result);
 
 // Performs a TCP read to socket sock, sending @message.
-void tcp_write(int socket, std::string message);
+void tcp_write(int socket, const std::string &message);
+
+// Returned by udp_read if a non-blocking socket has no datagram waiting.
+const ssize_t WOULD_BLOCK = -2;
+
+// A datagram received by udp_receive.
+struct Datagram {
+    uint16_t type;
+    // View of the payload in the buffer of the caller.
+    RingSpan payload;
+    // Whether the datagram was sent to a multicast or broadcast address rather than
+    // to this host. Known only if IP_PKTINFO is enabled on the socket.
+    bool group;
+};
+
+// Receives a single datagram from socket sock into @buf of @size bytes, which
+// takes a payload of LIMIT_MAX_PAYLOAD bytes. The header is read apart, so the
+// payload starts at @buf. If @address is not nullptr, saves the sender address to it.
+// Keeps no state, so threads may receive at the same time.
+// Returns the size of the payload, WOULD_BLOCK, or -1 if the message is incorrect.
+ssize_t udp_receive(int socket, char *buf, size_t size, sockaddr_in *address, Datagram &datagram);
 
 // Performs a UDP read from socket sock, saving the message to @result.
 // If @address is not nullptr, saves the sender address to it.
 // Reads using the protocol given in the task statement, saving the type to @type.
+// Returns -1 if the message is incorrect.
 ssize_t udp_read(int socket, std::string &result, sockaddr_in *address, uint16_t &type);
 
-// Performs a UDP write to socket sock, reading the message from @message.
+// Performs a UDP write to socket sock, sending the bytes viewed by @message.
 // If @address is not nullptr, sends the message to given address, otherwise writes to socket.
 // Writes using the protocol given in the task statement, reading the type from @type.
-void udp_write(int socket, std::string message, sockaddr_in *address, uint16_t type);
+// Headers are sent from a separate iovec, so the message is never copied.
+// A datagram the socket has no room for, or which cannot reach the address, is lost.
+// Returns the number of lost datagrams.
+size_t udp_write(int socket, const RingSpan &message, sockaddr_in *address, uint16_t type);
+
+// Performs a UDP write like the one above, sending @message.
+size_t udp_write(int socket, const std::string &message, sockaddr_in *address, uint16_t type);
+
+// Counters of the UDP fan-out.
+struct FanoutStats {
+    unsigned long long blocks;
+    unsigned long long datagrams;
+    unsigned long long syscalls;
+    // Sends stopped because the socket or the device had no room.
+    unsigned long long stalls;
+    // Datagrams which could not be sent to their recipient.
+    unsigned long long errors;
+};
+
+// Progress of udp_write_to_all: recipient @recipient gets fragments from @fragment on.
+struct FanoutPosition {
+    size_t recipient;
+    size_t fragment;
+};
+
+// Sends @message to @count addresses from @addresses, split into fragments like in udp_write.
+// Every fragment is encoded once and sent to all recipients in batches with sendmmsg.
+// With GSO, one message of a batch carries many fragments.
+// With @sequence, every fragment starts with it, numbered from @sequence->datagram,
+// and carries SEQUENCE_SIZE bytes of audio less.
+// Datagrams which cannot reach their recipient are skipped. If the socket runs out
+// of room, stops and returns false, saving the place to resume from to @position.
+// With @position, starts from the place saved there.
+bool udp_write_to_all(int socket, const RingSpan &message, const sockaddr_in *addresses,
+                      size_t count, uint16_t type, FanoutStats &stats,
+                      const AudioSequence *sequence = nullptr, FanoutPosition *position = nullptr);
+
+class IoUring;
+
+// Makes udp_write_to_all in the calling thread submit its batches to @ring
+// instead of calling sendmmsg. Null goes back to sendmmsg.
+void set_fanout_ring(IoUring *ring);
+
+// Number of fragments udp_write_to_all cuts a message of @size bytes into.
+size_t udp_fragments(size_t size, bool sequenced);
+
+// Largest part of a message carried by one fragment.
+size_t udp_fragment_payload(bool sequenced);
+
+// Prints a summary of fan-out counters to stderr.
+void print_fanout_stats(const FanoutStats &stats);
 
-// Performs a select on two sockets, with a given timeout.
-// If second socket is a non-positive number, it is ignored in the select.
-// Returns number of events, or -1, if select was interrupted.
-// Changes each socket to 1, if an event occurred, to -1 otherwise.
-int custom_select(int &sock1, int &sock2, timeval timeout);
+// Waits until socket @sock has data to read, for at most @timeout.
+// Returns 1 if it has, 0 on timeout, or -1 if the wait was interrupted.
+int wait_for_input(int sock, timeval timeout);
 
 // Converts sockaddr_in object into a unique string.
 std::string get_address_string(sockaddr_in &address);
@@ -0,0 +1,103 @@
+#include <algorithm>
+
+#include "my_time.h"
+#include "network.h"
+#include "pacer.h"
+#include "shard.h"
+
+using namespace std;
+
+namespace {
+    const long long tick_usec = 1000;
+    // Part of the time between blocks used for sending, leaving room for jitter.
+    const double send_window = 0.8;
+    const size_t max_queue = 4;
+    // Weight of a new sample in the smoothed time between blocks.
+    const double interval_weight = 0.125;
+    // Most ticks worth of tokens kept in the bucket.
+    const double max_ticks = 2;
+}
+
+Pacer::Pacer(Reactor &reactor, Sender send, Done done)
+    : reactor(reactor), send(send), done(done), armed(false), last_block(-1),
+      block_interval(0), rate(0), tokens(0), last_refill(0), counters() {
+    timer = reactor.create_timer([this]() {
+        armed = false;
+        tick();
+    });
+}
+
+void Pacer::push(const shared_ptr<const Block> &block, const AddressSnapshot &recipients, long long now) {
+    if (recipients->empty())
+        return;
+
+    // Metadata follows audio at once, so only audio tells the pace of the stream.
+    if (block->type == AUDIO) {
+        if (last_block >= 0) {
+            double gap = now - last_block;
+            block_interval = block_interval == 0 ? gap : block_interval + interval_weight * (gap - block_interval);
+        }
+        last_block = now;
+    }
+
+    if (queue.size() == max_queue) {
+        PacedBlock &oldest = queue.front();
+        counters.dropped += oldest.recipients->size() - oldest.sent;
+        shared_ptr<const Block> block = oldest.block;
+        queue.pop_front();
+        done(*block);
+    }
+    queue.push_back(PacedBlock{block, recipients, 0});
+    counters.blocks++;
+    counters.max_queue = max(counters.max_queue, (unsigned long long)queue.size());
+
+    // Everything waiting should be sent within the window.
+    double bytes = 0;
+    for (auto &paced : queue)
+        bytes += (double)paced.block->data.size() * (paced.recipients->size() - paced.sent);
+    rate = block_interval > 0 ? bytes / (send_window * block_interval) : 0;
+
+    // An idle pacer starts with a full bucket.
+    if (!armed) {
+        last_refill = now_usec();
+        tokens = capacity();
+        tick();
+    }
+}
+
+double Pacer::capacity() const {
+    double front = queue.empty() ? 0 : queue.front().block->data.size();
+    return max(rate * tick_usec * max_ticks, front);
+}
+
+void Pacer::tick() {
+    long long now = now_usec();
+    // Unused tokens are capped, but the refill of a late tick is never lost.
+    tokens = min(tokens, capacity()) + rate * (now - last_refill);
+    last_refill = now;
+
+    while (!queue.empty()) {
+        PacedBlock &paced = queue.front();
+        size_t left = paced.recipients->size() - paced.sent;
+        size_t size = max(paced.block->data.size(), (size_t)1);
+
+        // Without an estimate of the rate, the block goes out at once.
+        size_t count = rate == 0 ? left : min(left, (size_t)(tokens / size));
+        if (count == 0)
+            break;
+
+        send(paced.block, paced.recipients, paced.sent, count);
+        paced.sent += count;
+        tokens -= (double)count * size;
+
+        if (paced.sent == paced.recipients->size()) {
+            done(*paced.block);
+            queue.pop_front();
+        }
+    }
+
+    if (!queue.empty()) {
+        armed = true;
+        reactor.arm_timer(timer, tick_usec);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef DUZE_PACER_H
+#define DUZE_PACER_H
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <vector>
+
+#include "client_table.h"
+#include "reactor.h"
+
+struct Block;
+
+// Counters of a pacer.
+struct PacingStats {
+    unsigned long long blocks;
+    // Sends of a block to a single client given up because the pacer fell behind.
+    unsigned long long dropped;
+    unsigned long long max_queue;
+};
+
+// Spreads the fan-out of a station's blocks over the time between them, instead
+// of sending every fragment to every client in one burst that overflows NIC
+// queues and socket buffers of receivers.
+// A token bucket in bytes is refilled every tick of the reactor, at a rate at
+// which the queued fan-out ends a bit before the next block is expected.
+// The time between blocks is learned from their arrival. Recipients of a block
+// are the clients registered when it came, in a snapshot of their table, which
+// blocks that came while the clients stayed the same share. If more than a few blocks
+// are waiting, the oldest is dropped for the clients which did not get it yet.
+class Pacer {
+public:
+    // Sends a block to @count clients from position @first of @recipients.
+    typedef std::function<void(const std::shared_ptr<const Block> &, const AddressSnapshot &, size_t,
+                               size_t)> Sender;
+    // Called once for every pushed block, after it was sent to its last client
+    // or dropped.
+    typedef std::function<void(const Block &)> Done;
+
+    Pacer(Reactor &reactor, Sender send, Done done);
+
+    // Queues a block for @recipients, arriving at @now.
+    void push(const std::shared_ptr<const Block> &block, const AddressSnapshot &recipients, long long now);
+
+    const PacingStats &stats() const {
+        return counters;
+    }
+
+    // Number of blocks waiting or being sent.
+    size_t depth() const {
+        return queue.size();
+    }
+
+private:
+    struct PacedBlock {
+        std::shared_ptr<const Block> block;
+        AddressSnapshot recipients;
+        size_t sent;
+    };
+
+    // Size of the bucket: a few ticks worth of bytes, but at least a single send.
+    double capacity() const;
+
+    // Refills the bucket and sends what it allows.
+    void tick();
+
+    Reactor &reactor;
+    Sender send;
+    Done done;
+    int timer;
+    bool armed;
+
+    std::deque<PacedBlock> queue;
+    long long last_block;
+    double block_interval;
+    // Bytes per microsecond.
+    double rate;
+    double tokens;
+    long long last_refill;
+
+    PacingStats counters;
+};
+
+#endif //DUZE_PACER_H
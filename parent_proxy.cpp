@@ -0,0 +1,158 @@
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "live_stats.h"
+#include "my_time.h"
+#include "parent_proxy.h"
+#include "socket_manager.h"
+
+using namespace std;
+
+namespace {
+    const long long keepalive_period = 3500000;
+}
+
+ParentProxy::ParentProxy(Reactor &reactor, const station_params &parent, int timeout, Output output)
+    : reactor(reactor), address(resolve_address(parent.host, parent.port)),
+      timeout_usec(timeout * 1000000ll), output(output),
+      reorderer([this](const string &audio, long long received) {
+          this->output(AUDIO, RingSpan(audio.data(), audio.size()), received);
+      }),
+      stats_sent(0), stats_answered(true), parent_level(0), parent_path_latency(0),
+      parent_latency(0), hop() {
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        syserr("socket");
+
+    // Wait for the IAM, like for the header of a server.
+    send(DISCOVER, encode_capabilities(CAP_SEQUENCE | CAP_FEC));
+    long long deadline = now_usec() + timeout_usec;
+    bool registered = false;
+    while (!registered) {
+        long long left = deadline - now_usec();
+        if (left <= 0)
+            fatal("Parent proxy did not answer DISCOVER in time");
+        timeval wait = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+        int events = wait_for_input(sock, wait);
+        // The wait is only interrupted by SIGINT, which ends the program.
+        if (events < 0)
+            fatal("Interrupted while waiting for the parent proxy");
+        if (events == 0)
+            continue;
+
+        char buf[LIMIT_MAX_PAYLOAD];
+        Datagram datagram;
+        sockaddr_in sender;
+        if (udp_receive(sock, buf, sizeof buf, &sender, datagram) >= 0 && from_parent(sender)
+                && datagram.type == IAM) {
+            name = datagram.payload.to_string();
+            registered = true;
+        }
+    }
+    hop.level = 1;
+
+    keepalive_timer = reactor.create_timer([this]() {
+        send(KEEPALIVE, "");
+        stats_sent = now_usec();
+        stats_answered = false;
+        send(STATS, "");
+        this->reactor.arm_timer(keepalive_timer, keepalive_period);
+    });
+    // The depth in the tree is learnt at once.
+    reactor.arm_timer(keepalive_timer, 0);
+
+    silence_timer = reactor.create_timer([this]() {
+        // The parent may have forgotten the agent, or started anew with new numbers.
+        hop.rediscovers++;
+        reorderer.reset();
+        send(DISCOVER, encode_capabilities(CAP_SEQUENCE | CAP_FEC));
+        this->reactor.arm_timer(silence_timer, timeout_usec);
+    });
+    reactor.arm_timer(silence_timer, timeout_usec);
+
+    set_nonblocking(sock);
+    reactor.add(sock, EPOLLIN, [this](uint32_t) {
+        receive();
+    });
+}
+
+ParentProxy::~ParentProxy() {
+    reactor.timers().destroy(keepalive_timer);
+    reactor.timers().destroy(silence_timer);
+    close_socket(sock);
+}
+
+void ParentProxy::send(uint16_t type, const string &message) {
+    udp_write(sock, message, &address, type);
+}
+
+bool ParentProxy::from_parent(const sockaddr_in &sender) const {
+    return sender.sin_addr.s_addr == address.sin_addr.s_addr && sender.sin_port == address.sin_port;
+}
+
+void ParentProxy::receive() {
+    char buf[LIMIT_MAX_PAYLOAD];
+    Datagram datagram;
+    sockaddr_in sender;
+    while (true) {
+        ssize_t rcv_len = udp_receive(sock, buf, sizeof buf, &sender, datagram);
+        if (rcv_len == WOULD_BLOCK)
+            break;
+        if (rcv_len < 0) {
+            cerr << "Incorrect UDP header\n";
+        } else if (from_parent(sender)) {
+            handle(datagram, now_usec());
+        }
+    }
+}
+
+void ParentProxy::handle(const Datagram &datagram, long long received) {
+    reactor.arm_timer(silence_timer, timeout_usec);
+
+    if (datagram.type == AUDIO_SEQ) {
+        if (!reorderer.push(datagram.payload, received))
+            cerr << "Incorrect sequence header\n";
+    } else if (datagram.type == FEC) {
+        if (!reorderer.push_parity(datagram.payload, received))
+            cerr << "Incorrect parity\n";
+    } else if (datagram.type == AUDIO || datagram.type == METADATA) {
+        // A parent without sequence numbers sends audio as it comes.
+        output(datagram.type, datagram.payload, received);
+    } else if (datagram.type == STATS) {
+        handle_stats(datagram.payload, received);
+    } else if (datagram.type == IAM) {
+        name = datagram.payload.to_string();
+    }
+}
+
+void ParentProxy::handle_stats(const RingSpan &report, long long received) {
+    if (!stats_answered) {
+        stats_answered = true;
+        hop.rtt_usec = received - stats_sent;
+        stats_line.clear();
+    }
+
+    // A long report comes in many datagrams, split anywhere.
+    for (size_t i = 0; i < report.size(); i++) {
+        if (report[i] != '\n') {
+            stats_line += report[i];
+            continue;
+        }
+        string field;
+        long long value;
+        if (parse_report_line(stats_line, field, value)) {
+            if (field == "relay_level")
+                parent_level = value;
+            else if (field == "relay_path_latency_usec")
+                parent_path_latency = value;
+            else if (field == "latency_p50_usec")
+                parent_latency = value;
+        }
+        stats_line.clear();
+    }
+
+    hop.level = parent_level + 1;
+    hop.path_latency_usec = parent_path_latency + parent_latency + hop.rtt_usec / 2;
+}
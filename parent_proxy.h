@@ -0,0 +1,92 @@
+#ifndef DUZE_PARENT_PROXY_H
+#define DUZE_PARENT_PROXY_H
+
+#include <functional>
+#include <netinet/in.h>
+#include <string>
+
+#include "audio_reorderer.h"
+#include "network.h"
+#include "parser.h"
+#include "reactor.h"
+
+// Numbers of the hop from a parent proxy.
+struct HopStats {
+    // Depth of this proxy in the tree, one more than the parent's.
+    long long level;
+    // Round trip of the last STATS request answered by the parent.
+    long long rtt_usec;
+    // Estimated time from the root proxy receiving a block from its server to this
+    // proxy receiving it: the path latency of the parent, its median latency from
+    // upstream to agents, and half of the round trip.
+    long long path_latency_usec;
+    // DISCOVER messages sent again after the parent was silent.
+    unsigned long long rediscovers;
+};
+
+// The stream of a station relayed by another radio-proxy, taken the way radio-client
+// takes it: as an agent announcing CAP_SEQUENCE and CAP_FEC, so that fragments are
+// put back into whole blocks and lost ones are rebuilt from parity. The parent hears
+// from the agent with every KEEPALIVE, and is asked for STATS along with it, to learn
+// its depth in the tree and the round trip to it.
+class ParentProxy {
+public:
+    // Gets an AUDIO or METADATA block and the time it was received.
+    typedef std::function<void(uint16_t, const RingSpan &, long long)> Output;
+
+    // Registers with the proxy at @parent, waiting at most @timeout seconds for its IAM,
+    // and exits if it does not come. From then on the socket is served by @reactor.
+    // A parent silent for @timeout seconds is sent a DISCOVER again.
+    ParentProxy(Reactor &reactor, const station_params &parent, int timeout, Output output);
+
+    ~ParentProxy();
+
+    const std::string &radio_name() const {
+        return name;
+    }
+
+    const HopStats &hop_stats() const {
+        return hop;
+    }
+
+    const ReorderStats &reorder_stats() const {
+        return reorderer.stats();
+    }
+
+private:
+    // Sends a message of type @type to the parent.
+    void send(uint16_t type, const std::string &message);
+
+    // Whether @sender is the parent, and not another station of it.
+    bool from_parent(const sockaddr_in &sender) const;
+
+    // Reads all waiting datagrams.
+    void receive();
+
+    // Takes a datagram of the parent received at @received.
+    void handle(const Datagram &datagram, long long received);
+
+    // Takes a piece of a STATS reply received at @received.
+    void handle_stats(const RingSpan &report, long long received);
+
+    Reactor &reactor;
+    sockaddr_in address;
+    int sock;
+    long long timeout_usec;
+    std::string name;
+    Output output;
+    AudioReorderer reorderer;
+    int keepalive_timer;
+    int silence_timer;
+    // When the last STATS request was sent, and the unfinished line of its reply.
+    long long stats_sent;
+    bool stats_answered;
+    std::string stats_line;
+    // Numbers read from the report of the parent.
+    long long parent_level;
+    long long parent_path_latency;
+    long long parent_latency;
+    HopStats hop;
+};
+
+#endif //DUZE_PARENT_PROXY_H
@@ -2,6 +2,8 @@
 #include <iostream>
 #include <string.h>
 
+#include "fec.h"
+#include "network.h"
 #include "parser.h"
 
 using namespace std;
@@ -30,23 +32,38 @@ proxy_params parse_proxy_params(int argc, char *argv[], void (*print_usage)()) {
     params.multicast_address = "";
     params.agent_timeout = 5;
     params.agent_active = false;
-    bool h = false, r = false, p = false, m = false, t = false, P = false, B = false, T = false;
+    params.shards = 1;
+    params.burst_blocks = 0;
+    params.pacing = false;
+    params.max_payload = DEFAULT_MAX_PAYLOAD;
+    params.gso = true;
+    params.fec_group = 0;
+    params.group_address = "";
+    params.group_port = 0;
+    params.group_ttl = 4;
+    params.group_interface = "";
+    params.io_uring = false;
+    params.splice = true;
+    params.standby = false;
+    vector<string> hosts, resources;
+    vector<int> ports;
+    // Mirrors with the station they belong to.
+    vector<pair<size_t, station_params>> mirrors;
+    bool m = false, t = false, P = false, B = false, T = false, S = false, b = false, R = false, M = false, G = false, F = false,
+         A = false, L = false, I = false, E = false, Z = false, W = false;
     for (int i = 1; i < argc; i += 2) {
         if (strlen(argv[i]) != 2 || argv[i][0] != '-')
             print_usage();
         switch (argv[i][1]) {
             case 'h':
-                check(h, print_usage);
-                params.host = argv[i+1];
+                hosts.push_back(argv[i+1]);
                 break;
             case 'r':
-                check(r, print_usage);
-                params.resource = argv[i+1];
+                resources.push_back(argv[i+1]);
                 break;
             case 'p':
-                check(p, print_usage);
                 check_if_number(argv[i+1], "port");
-                params.port = atoi(argv[i+1]);
+                ports.push_back(atoi(argv[i+1]));
                 break;
             case 'm':
                 check(m, print_usage);
@@ -81,14 +98,155 @@ proxy_params parse_proxy_params(int argc, char *argv[], void (*print_usage)()) {
                 if (params.agent_timeout == 0)
                     print_usage();
                 break;
+            case 'S':
+                check(S, print_usage);
+                check_if_number(argv[i+1], "shards");
+                params.shards = atoi(argv[i+1]);
+                if (params.shards == 0)
+                    print_usage();
+                break;
+            case 'b':
+                check(b, print_usage);
+                check_if_number(argv[i+1], "burst_blocks");
+                params.burst_blocks = atoi(argv[i+1]);
+                break;
+            case 'R':
+                check(R, print_usage);
+                if (!strcmp(argv[i+1], "no"))
+                    params.pacing = false;
+                else if (!strcmp(argv[i+1], "yes"))
+                    params.pacing = true;
+                else
+                    print_usage();
+                break;
+            case 'M':
+                check(M, print_usage);
+                check_if_number(argv[i+1], "max_payload");
+                params.max_payload = atoi(argv[i+1]);
+                if (params.max_payload < (int)MIN_MAX_PAYLOAD || params.max_payload > (int)LIMIT_MAX_PAYLOAD)
+                    print_usage();
+                break;
+            case 'G':
+                check(G, print_usage);
+                if (!strcmp(argv[i+1], "no"))
+                    params.gso = false;
+                else if (!strcmp(argv[i+1], "yes"))
+                    params.gso = true;
+                else
+                    print_usage();
+                break;
+            case 'F':
+                check(F, print_usage);
+                check_if_number(argv[i+1], "fec_group");
+                params.fec_group = atoi(argv[i+1]);
+                if (params.fec_group > LIMIT_FEC_GROUP)
+                    print_usage();
+                break;
+            case 'A': {
+                check(A, print_usage);
+                string group = argv[i+1];
+                size_t colon = group.find(':');
+                if (colon == string::npos || colon == 0)
+                    print_usage();
+                params.group_address = group.substr(0, colon);
+                string port = group.substr(colon + 1);
+                check_if_number(&port[0], "group port");
+                params.group_port = atoi(port.c_str());
+                if (params.group_port == 0)
+                    print_usage();
+                break;
+            }
+            case 'L':
+                check(L, print_usage);
+                check_if_number(argv[i+1], "group_ttl");
+                params.group_ttl = atoi(argv[i+1]);
+                if (params.group_ttl > 255)
+                    print_usage();
+                break;
+            case 'I':
+                check(I, print_usage);
+                params.group_interface = argv[i+1];
+                break;
+            case 'E':
+                check(E, print_usage);
+                if (!strcmp(argv[i+1], "epoll"))
+                    params.io_uring = false;
+                else if (!strcmp(argv[i+1], "io_uring"))
+                    params.io_uring = true;
+                else
+                    print_usage();
+                break;
+            case 'Z':
+                check(Z, print_usage);
+                if (!strcmp(argv[i+1], "no"))
+                    params.splice = false;
+                else if (!strcmp(argv[i+1], "yes"))
+                    params.splice = true;
+                else
+                    print_usage();
+                break;
+            case 'U': {
+                if (hosts.empty())
+                    print_usage();
+                // host:port, optionally followed by the resource.
+                string mirror = argv[i+1];
+                size_t slash = mirror.find('/');
+                string resource = slash == string::npos ? "" : mirror.substr(slash);
+                mirror = mirror.substr(0, slash);
+                size_t colon = mirror.rfind(':');
+                if (colon == string::npos || colon == 0)
+                    print_usage();
+                string port = mirror.substr(colon + 1);
+                check_if_number(&port[0], "mirror port");
+                mirrors.emplace_back(hosts.size() - 1,
+                                     station_params{mirror.substr(0, colon), resource, atoi(port.c_str())});
+                break;
+            }
+            case 'C': {
+                string parent = argv[i+1];
+                size_t colon = parent.rfind(':');
+                if (colon == string::npos || colon == 0)
+                    print_usage();
+                string port = parent.substr(colon + 1);
+                check_if_number(&port[0], "parent port");
+                params.parents.push_back(station_params{parent.substr(0, colon), "", atoi(port.c_str())});
+                break;
+            }
+            case 'W':
+                check(W, print_usage);
+                if (!strcmp(argv[i+1], "no"))
+                    params.standby = false;
+                else if (!strcmp(argv[i+1], "yes"))
+                    params.standby = true;
+                else
+                    print_usage();
+                break;
             default:
                 print_usage();
         }
     }
-    if ((B || T) && !P)
+    if ((B || T || S || b || R || M || G || F || A) && !P)
+        print_usage();
+    if (Z && P)
+        print_usage();
+    if ((L || I) && !A)
         print_usage();
-    if (!h || !r || !p)
+    if ((hosts.empty() && params.parents.empty()) || hosts.size() != resources.size()
+            || hosts.size() != ports.size())
         print_usage();
+    // Without agents, the audio of many stations would be mixed on the standard output.
+    if (hosts.size() + params.parents.size() > 1 && !P)
+        print_usage();
+    for (size_t i = 0; i < hosts.size(); i++) {
+        params.stations.push_back(station_params{hosts[i], resources[i], ports[i]});
+    }
+    params.mirrors.resize(hosts.size());
+    for (auto &mirror : mirrors) {
+        // Mirrors serve the resource of their station unless told otherwise.
+        if (mirror.second.resource.empty())
+            mirror.second.resource = resources[mirror.first];
+        params.mirrors[mirror.first].push_back(mirror.second);
+    }
     return params;
 }
 
@@ -131,4 +289,40 @@ client_params parse_client_params(int argc, char *argv[], void (*print_usage)())
     if (!H || !P || !p)
         print_usage();
     return params;
-}
\ No newline at end of file
+}
+
+stats_params parse_stats_params(int argc, char *argv[], void (*print_usage)()) {
+    if (argc % 2 != 1) {
+        print_usage();
+    }
+    stats_params params;
+    params.timeout = 1;
+    bool H = false, P = false, T = false;
+    for (int i = 1; i < argc; i += 2) {
+        if (strlen(argv[i]) != 2 || argv[i][0] != '-')
+            print_usage();
+        switch (argv[i][1]) {
+            case 'H':
+                check(H, print_usage);
+                params.host = argv[i+1];
+                break;
+            case 'P':
+                check(P, print_usage);
+                check_if_number(argv[i+1], "port");
+                params.port = atoi(argv[i+1]);
+                break;
+            case 'T':
+                check(T, print_usage);
+                check_if_number(argv[i+1], "timeout");
+                params.timeout = atoi(argv[i+1]);
+                if (params.timeout == 0)
+                    print_usage();
+                break;
+            default:
+                print_usage();
+        }
+    }
+    if (!H || !P)
+        print_usage();
+    return params;
+}
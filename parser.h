@@ -2,11 +2,20 @@
 #define DUZE_PARSER_H
 
 #include <string>
+#include <vector>
 
-struct proxy_params {
+struct station_params {
     std::string host;
     std::string resource;
     int port;
+};
+
+struct proxy_params {
+    std::vector<station_params> stations;
+    // Mirrors of the i-th station, taking over when its server fails.
+    std::vector<std::vector<station_params>> mirrors;
+    // Agent ports of other proxies whose stations are relayed, after those of servers.
+    std::vector<station_params> parents;
     int metadata;
     int timeout;
 
@@ -14,6 +23,31 @@ struct proxy_params {
     std::string multicast_address;
     int agent_timeout;
     bool agent_active;
+    int shards;
+    // Number of recent audio blocks sent to a new client, 0 disables the burst.
+    int burst_blocks;
+    // Whether the fan-out is spread over the time between blocks.
+    bool pacing;
+    // Largest payload of a datagram sent to agents.
+    int max_payload;
+    // Whether to let the kernel cut fragments (UDP GSO), when it can.
+    bool gso;
+    // Fragments of an audio block covered by one parity datagram, 0 disables parity.
+    int fec_group;
+    // Multicast group getting the audio of the first station, empty if audio is unicast.
+    // Further stations use the following ports.
+    std::string group_address;
+    int group_port;
+    // TTL of group datagrams.
+    int group_ttl;
+    // Address of the interface sending group datagrams, empty for the default one.
+    std::string group_interface;
+    // Whether upstream reads and the fan-out go through io_uring instead of epoll and sendmmsg.
+    bool io_uring;
+    // Whether audio goes from the server to a standard output pipe with splice, without agents.
+    bool splice;
+    // Whether a second connection to every station is kept ready to take over.
+    bool standby;
 };
 
 struct client_params {
@@ -23,10 +57,23 @@ struct client_params {
     int timeout;
 };
 
+struct stats_params {
+    std::string host;
+    int port;
+    int timeout;
+};
+
 // Parse given radio-proxy params, returning them in a dedicated struct.
+// Options -h, -r and -p may be repeated to relay many stations,
+// the i-th host is paired with the i-th resource and the i-th port.
+// Option -U adds a mirror of the station given by the last -h.
+// Option -C, which may be repeated too, relays a station of another proxy.
 proxy_params parse_proxy_params(int argc, char *argv[], void (*print_usage)());
 
 // Parse given client-proxy params, returning them in a dedicated struct.
 client_params parse_client_params(int argc, char *argv[], void (*print_usage)());
 
+// Parse given radio-stats params, returning them in a dedicated struct.
+stats_params parse_stats_params(int argc, char *argv[], void (*print_usage)());
+
 #endif //DUZE_PARSER_H
@@ -0,0 +1,27 @@
+#ifndef DUZE_PIPELINE_H
+#define DUZE_PIPELINE_H
+
+#include <cstddef>
+
+#include "icy_demuxer.h"
+
+// Takes all complete blocks out of @demuxer, handing audio to sink.audio(data)
+// and metadata to sink.metadata(data). Returns the number of blocks.
+// It is instantiated for every metadata mode and sink, so that the loop is
+// picked once for a stream and checks neither of them per block.
+// @Metadata must match the mode of the demuxer.
+template <bool Metadata, class Sink>
+size_t relay_blocks(IcyDemuxer &demuxer, Sink &sink) {
+    IcyBlock block;
+    size_t blocks = 0;
+    while (demuxer.next<Metadata>(block)) {
+        blocks++;
+        if (Metadata && block.type == METADATA)
+            sink.metadata(block.data);
+        else
+            sink.audio(block.data);
+    }
+    return blocks;
+}
+
+#endif //DUZE_PIPELINE_H
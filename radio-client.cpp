@@ -1,26 +1,38 @@
 #include <arpa/inet.h>
 #include <csignal>
+#include <functional>
 #include <iostream>
 #include <map>
-#include <vector>
+#include <tuple>
 
+#include "audio_reorderer.h"
 #include "err.h"
+#include "latency_histogram.h"
 #include "my_time.h"
 #include "network.h"
 #include "parser.h"
 #include "socket_manager.h"
+#include "timer_wheel.h"
 
 using namespace std;
 
 // Program constants.
 const int keepalive_frequency = 3500;
+const long long timer_tick = 1000;
+// Position of the socket listening to a group in the poll array.
+const size_t group_socket = 3;
 
 bool finish_program = false;
+bool dump_requested = false;
 
 void signalHandler( __attribute__((unused))int signum ) {
     finish_program = true;
 }
 
+void dumpHandler( __attribute__((unused))int signum ) {
+    dump_requested = true;
+}
+
 void print_usage() {
     cerr << "Usage: ./radio-client -H host -P port -p control_port [-T timeout]" << endl;
     exit(1);
@@ -29,46 +41,63 @@ void print_usage() {
 struct Radio {
     string name;
     string address;
-    timeval last_message;
     sockaddr_in sock_address;
+    int expiry_timer;
 
     Radio() {}
 
-    Radio(string reply, string address, sockaddr_in sock_address)
-        : name(reply), address(address), sock_address(sock_address) {
-        last_message = time_now();
-    }
+    Radio(string reply, string address, sockaddr_in sock_address, int expiry_timer)
+        : name(reply), address(address), sock_address(sock_address), expiry_timer(expiry_timer) {}
+};
 
-    void update_time() {
-        last_message = time_now();
-    }
+// Multicast group the client listens to for the audio of the active radio.
+struct AudioGroup {
+    // Address of the radio which announced the group, empty if none is joined.
+    string radio;
+    sockaddr_in address;
+    ip_mreq membership;
 };
 
-// Checks which radios are active and remove the inactive ones.
-// While removing radios, updates the cursor position.
-bool check_alive(map<string, Radio> &radio_map, bool &telnet_update_needed, string &active, int timeout, int &cursor) {
-    vector<string> to_remove;
-    int row = 2;
-    for (auto it = radio_map.begin(); it != radio_map.end(); it++) {
-        if (microseconds_passed_from(it->second.last_message) > timeout * 1000000) {
-            to_remove.push_back(it->first);
-            telnet_update_needed = true;
-            if (row <= cursor)
-                cursor--;
-        }
-        row++;
-    }
+// Leaves the joined group and closes its socket.
+void leave_group(pollfd &socket, AudioGroup &group) {
+    close_multicast_socket(socket.fd, group.membership);
+    socket.fd = -1;
+    group.radio = "";
+}
 
-    for (auto rem : to_remove) {
-        radio_map.erase(rem);
-    }
+// Joins a group announced by a given radio, leaving the previous one.
+void join_group(pollfd &socket, AudioGroup &group, const string &radio, const sockaddr_in &address) {
+    if (group.radio == radio && group.address.sin_addr.s_addr == address.sin_addr.s_addr
+            && group.address.sin_port == address.sin_port)
+        return;
+    if (socket.fd != -1)
+        leave_group(socket, group);
+
+    // Other clients on this host may listen to the same group.
+    tie(socket.fd, group.membership) = create_multicast_socket(inet_ntoa(address.sin_addr),
+            ntohs(address.sin_port), true);
+    socket.events = POLLIN;
+    group.radio = radio;
+    group.address = address;
+}
+
+// Removes a radio whose timer expired.
+// While removing the radio, updates the cursor position.
+void remove_radio(map<string, Radio> &radio_map, TimerWheel &timers, const string &address,
+        bool &telnet_update_needed, string &active, string &current_metadata, int &cursor) {
+    auto it = radio_map.find(address);
+    int row = 2 + distance(radio_map.begin(), it);
 
-    if (radio_map.find(active) == radio_map.end()) {
+    timers.destroy(it->second.expiry_timer);
+    radio_map.erase(it);
+
+    telnet_update_needed = true;
+    if (row <= cursor)
+        cursor--;
+    if (address == active) {
         active = "";
-        return false;
+        current_metadata = "";
     }
-
-    return true;
 }
 
 // Updates the menu in the controlling telnet.
@@ -123,35 +152,65 @@ void manage_control_connections(pollfd *client, bool &telnet_update_needed) {
     }
 }
 
-// Checks if a message with audio/metadata or an iam came.
-// If so, handles it in a proper way.
-void music_socket(pollfd *client, map<string, Radio> &radio_map, string &active_radio_address,
-        string &current_metadata, int &cursor, bool &telnet_update_needed) {
-    if (client[0].revents & POLLIN) {
+// Checks if a message with audio/metadata or an iam came to socket @music.
+// If so, handles it in a proper way. A group announced by the active radio is joined
+// with the last socket.
+// A radio which is silent for @timeout seconds is removed with @expire_radio.
+// The time from receiving audio to writing it out is recorded in @latency.
+// Sequenced audio goes out through @reorderer.
+void music_socket(pollfd *client, size_t music, map<string, Radio> &radio_map,
+        string &active_radio_address, string &current_metadata, int &cursor,
+        bool &telnet_update_needed, TimerWheel &timers, int timeout,
+        const function<void(const string &)> &expire_radio, LatencyHistogram &latency,
+        AudioReorderer &reorderer, AudioGroup &group) {
+    if (client[music].fd != -1 && (client[music].revents & POLLIN)) {
         sockaddr_in sender_address;
-        string reply;
-        uint16_t type;
+        char buf[LIMIT_MAX_PAYLOAD];
+        Datagram datagram;
 
-        ssize_t rcv_len = udp_read(client[0].fd, reply, &sender_address, type);
-        string char_address = get_address_string(sender_address);
+        ssize_t rcv_len = udp_receive(client[music].fd, buf, sizeof buf, &sender_address, datagram);
+        uint16_t type = datagram.type;
+        const RingSpan &reply = datagram.payload;
+        long long received = now_usec();
+        // Group datagrams may come from another address of the proxy.
+        string char_address = music == group_socket ? group.radio : get_address_string(sender_address);
 
         if (rcv_len >= 0) {
             if (type == IAM) {
                 telnet_update_needed = true;
                 int exists = radio_map.count(char_address);
 
-                radio_map[char_address] = Radio(reply, char_address, sender_address);
+                if (exists) {
+                    radio_map[char_address].name = reply.to_string();
+                } else {
+                    int timer = timers.create([char_address, &expire_radio]() {
+                        expire_radio(char_address);
+                    });
+                    radio_map[char_address] = Radio(reply.to_string(), char_address, sender_address, timer);
+                }
 
                 if (!exists && distance(radio_map.begin(), radio_map.find(char_address)) <= cursor - 2) {
                     cursor++;
                 }
             } else if (type == AUDIO) {
                 if (char_address == active_radio_address) {
-                    fwrite(reply.c_str(), sizeof(char), rcv_len, stdout);
+                    fwrite(buf, sizeof(char), rcv_len, stdout);
+                    latency.record(now_usec() - received);
                 }
+            } else if (type == AUDIO_SEQ) {
+                if (char_address == active_radio_address && !reorderer.push(reply, received))
+                    cerr << "Incorrect sequence header\n";
+            } else if (type == FEC) {
+                if (char_address == active_radio_address && !reorderer.push_parity(reply, received))
+                    cerr << "Incorrect parity\n";
+            } else if (type == GROUP) {
+                sockaddr_in group_address;
+                if (!decode_group(reply, group_address))
+                    cerr << "Incorrect group\n";
+                else if (char_address == active_radio_address)
+                    join_group(client[group_socket], group, char_address, group_address);
             } else if (type == METADATA) {
-                reply.erase(0, 1);
-                current_metadata = reply;
+                current_metadata = reply.sub(1, reply.size()).to_string();
                 telnet_update_needed = true;
             } else {
                 cerr << "Unknown message type\n";
@@ -161,7 +220,7 @@ void music_socket(pollfd *client, map<string, Radio> &radio_map, string &active_
         }
 
         if (radio_map.count(char_address)) {
-            radio_map[char_address].update_time();
+            timers.schedule(radio_map[char_address].expiry_timer, now_usec() + timeout * 1000000ll);
         } else {
             cerr << "Unknown message sender\n";
         }
@@ -171,8 +230,8 @@ void music_socket(pollfd *client, map<string, Radio> &radio_map, string &active_
 // Checks if any characters came from controlling telnet.
 // If so, handles them in a proper way.
 void program_control(pollfd *client, map<string, Radio> &radio_map, string &active_radio_address,
-        string &current_metadata, int &cursor, timeval &last_keepalive,
-        sockaddr_in &multicast_address, bool &telnet_update_needed) {
+        string &current_metadata, int &cursor, TimerWheel &timers, int keepalive_timer,
+        sockaddr_in &multicast_address, bool &telnet_update_needed, AudioReorderer &reorderer) {
     if (client[2].fd != -1 && (client[2].revents & (POLLIN | POLLERR))) {
         string read_reply;
 
@@ -196,7 +255,7 @@ void program_control(pollfd *client, map<string, Radio> &radio_map, string &acti
                 cursor = max(cursor, 1);
             } else if (read_reply.size() == 2 && read_reply[0] == '\r' && read_reply[1] == '\0') {
                 if (cursor == 1) {
-                    udp_write(client[0].fd, "", &multicast_address, DISCOVER);
+                    udp_write(client[0].fd, encode_capabilities(CAP_SEQUENCE | CAP_FEC | CAP_GROUP), &multicast_address, DISCOVER);
                 } else if (cursor == (int)radio_map.size() + 2) {
                     finish_program = true;
                 } else {
@@ -204,12 +263,15 @@ void program_control(pollfd *client, map<string, Radio> &radio_map, string &acti
                     advance(it, cursor - 2);
                     Radio picked_radio = it->second;
 
-                    if (active_radio_address != picked_radio.address)
+                    if (active_radio_address != picked_radio.address) {
                         current_metadata = "";
+                        reorderer.reset();
+                    }
 
                     active_radio_address = picked_radio.address;
-                    last_keepalive = time_now();
-                    udp_write(client[0].fd, "", &picked_radio.sock_address, DISCOVER);
+                    timers.schedule(keepalive_timer, now_usec() + keepalive_frequency * 1000ll);
+                    udp_write(client[0].fd, encode_capabilities(CAP_SEQUENCE | CAP_FEC | CAP_GROUP), &picked_radio.sock_address,
+                            DISCOVER);
                 }
             }
         }
@@ -220,59 +282,89 @@ void program_control(pollfd *client, map<string, Radio> &radio_map, string &acti
 void run(client_params &params) {
     map<string, Radio> radio_map;
     string active_radio_address = "", current_metadata = "";
-    timeval last_keepalive = time_now();
     int cursor = 1;
+    bool telnet_update_needed = false;
     sockaddr_in multicast_address;
 
-    pollfd client[3];
+    // The last socket listens to the group of the active radio, if it has one.
+    pollfd client[4];
+    AudioGroup group;
 
     create_poll(client, multicast_address, params.host, params.port, params.control_port);
+    client[group_socket].fd = -1;
+    client[group_socket].events = POLLIN;
+
+    TimerWheel timers(timer_tick, now_usec());
+    LatencyHistogram latency;
+    AudioReorderer reorderer([&latency](const string &audio, long long received) {
+        fwrite(audio.data(), sizeof(char), audio.size(), stdout);
+        latency.record(now_usec() - received);
+    });
+
+    function<void(const string &)> expire_radio = [&](const string &address) {
+        remove_radio(radio_map, timers, address, telnet_update_needed, active_radio_address,
+                current_metadata, cursor);
+    };
+
+    // Sends a KEEPALIVE to the active radio, armed when a radio is picked.
+    int keepalive_timer = timers.create([&]() {
+        if (active_radio_address != "") {
+            udp_write(client[0].fd, "", &radio_map[active_radio_address].sock_address, KEEPALIVE);
+            timers.schedule(keepalive_timer, now_usec() + keepalive_frequency * 1000ll);
+        }
+    });
 
     // Main program loop
     while (!finish_program) {
-        for (int i = 0; i < 3; ++i)
+        for (int i = 0; i < 4; ++i)
             client[i].revents = 0;
 
-        timeval last_message = time_now();
-        if (active_radio_address != "") {
-            last_message = radio_map[active_radio_address].last_message;
-        }
+        // Waits at most until the next timer expires.
+        long long wait_time = timers.next_timeout(now_usec());
+        int poll_timeout = wait_time < 0 ? -1 : (wait_time + 999) / 1000;
 
-        // Sets wait time to be at most time left to timeout or next KEEPALIVE.
-        long long wait_time = to_usec(time_left(last_message, params.timeout));
-        wait_time = min(wait_time, to_usec(time_left(last_keepalive, keepalive_frequency)));
-
-        if (poll(client, 3, wait_time / 1000 + 1) == -1) {
-            if (errno != EINTR) {
+        if (poll(client, 4, poll_timeout) == -1) {
+            if (errno != EINTR)
                 syserr("poll");
-            } else {
-                finish_program = true;
-            }
         } else {
-            bool telnet_update_needed = false;
+            telnet_update_needed = false;
 
             manage_control_connections(client, telnet_update_needed);
 
-            music_socket(client, radio_map, active_radio_address, current_metadata,
-                    cursor, telnet_update_needed);
+            for (size_t music : {(size_t)0, group_socket}) {
+                music_socket(client, music, radio_map, active_radio_address, current_metadata,
+                        cursor, telnet_update_needed, timers, params.timeout, expire_radio, latency,
+                        reorderer, group);
+            }
 
             program_control(client, radio_map, active_radio_address, current_metadata,
-                    cursor, last_keepalive, multicast_address, telnet_update_needed);
+                    cursor, timers, keepalive_timer, multicast_address, telnet_update_needed,
+                    reorderer);
 
-            if (microseconds_passed_from(last_keepalive) > keepalive_frequency * 1000 && active_radio_address != "") {
-                udp_write(client[0].fd, "", &radio_map[active_radio_address].sock_address, KEEPALIVE);
-                last_keepalive = time_now();
-            }
+            timers.advance(now_usec());
+
+            // The group of a radio which is no longer active is of no use.
+            if (client[group_socket].fd != -1 && group.radio != active_radio_address)
+                leave_group(client[group_socket], group);
 
-            if (!check_alive(radio_map, telnet_update_needed, active_radio_address, params.timeout, cursor)) {
-                current_metadata = "";
-            }
             if (telnet_update_needed) {
                 send_update_to_telnet(radio_map, client, active_radio_address, current_metadata, cursor);
             }
         }
+
+        if (dump_requested) {
+            dump_requested = false;
+            cerr << "Latency from receive to output: " << latency_summary(latency) << "\n";
+            const ReorderStats &sequence = reorderer.stats();
+            cerr << "Sequenced audio: " << sequence.blocks << " blocks, " << sequence.dropped_blocks
+                 << " dropped, " << sequence.lost_datagrams << " datagrams lost, "
+                 << sequence.reordered << " reordered, " << sequence.late << " late, "
+                 << sequence.recovered << " recovered\n";
+        }
     }
 
+    if (client[group_socket].fd >= 0)
+        leave_group(client[group_socket], group);
     for (int i = 0; i < 3; ++i)
         if (client[i].fd >= 0)
             close_socket(client[i].fd);
@@ -281,6 +373,7 @@ void run(client_params &params) {
 
 int main(int argc, char *argv[]) {
     signal(SIGINT, signalHandler);
+    signal(SIGUSR1, dumpHandler);
 
     client_params params = parse_client_params(argc, argv, print_usage);
 
@@ -1,88 +1,160 @@
 #include <algorithm>
 #include <arpa/inet.h>
 #include <csignal>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
-#include <map>
+#include <memory>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 #include "err.h"
+#include "fec.h"
+#include "icy_demuxer.h"
+#include "icy_header.h"
+#include "io_uring.h"
+#include "live_stats.h"
 #include "my_time.h"
 #include "network.h"
+#include "parent_proxy.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "shard.h"
 #include "socket_manager.h"
+#include "upstream.h"
 
 using namespace std;
 
 bool finish_program = false;
 
 // Program constants.
-const int default_package_size = 4000;
 const string default_radio_name = "Unknown";
+const long long stats_period = 1000000;
+// Upstream reads through io_uring land in a ring of provided buffers.
+const unsigned upstream_ring_entries = 64;
+const unsigned upstream_buffers = 64;
+const size_t upstream_buffer_size = 16384;
+const uint16_t upstream_buffer_group = 0;
+// Pause before a new connection after one failed, once every server was tried.
+const long long reconnect_delay = 1000000;
 
 void signalHandler( __attribute__((unused))int signum ) {
     finish_program = true;
 }
 
 void print_usage() {
-    cerr << "Usage: ./radio-proxy -h host -r resource -p port [-m yes|no] [-t timeout] " <<
-            "[-P agent_port [-B multicast_address] [-T agent_timeout]" << endl;
+    cerr << "Usage: ./radio-proxy -h host -r resource -p port [-h host -r resource -p port ...] [-C parent_host:port ...] " <<
+            "[-U host:port[/resource] ...] [-W yes|no] [-m yes|no] [-t timeout] [-E epoll|io_uring] [-Z yes|no] [-P agent_port [-B multicast_address] [-T agent_timeout] [-S shards] [-b burst_blocks] [-R yes|no] [-M max_payload] [-G yes|no] [-F fec_group] [-A group_address:port [-L ttl] [-I interface]]]" << endl;
     exit(1);
 }
 
-struct Client {
-    timeval last_message;
-    sockaddr_in sock_address;
-
-    Client() {}
-
-    Client(sockaddr_in sock_address) : sock_address(sock_address) {
-        last_message = time_now();
-    }
-
-    void update_time() {
-        last_message = time_now();
+struct Station;
+
+// Sends all complete blocks gathered by the demuxer of a station, read at @received.
+typedef void (*Relay)(Station &station, proxy_params &params, vector<unique_ptr<Shard>> &shards,
+        long long received);
+
+// Hands a block of type @type which a station got from its parent proxy at @received to its sink.
+typedef void (*Forward)(Station &station, proxy_params &params, vector<unique_ptr<Shard>> &shards,
+        uint16_t type, const RingSpan &data, long long received);
+
+// Upstream state of a single relayed station.
+// Its agents are served by the shards.
+struct Station {
+    size_t index;
+    // Servers of the station: the one given with -h, then its mirrors.
+    vector<station_params> sources;
+    // The servers with their addresses, resolved at the start for failover.
+    vector<UpstreamSource> resolved;
+    int metadata;
+    int sock;
+    string radio_name;
+    unique_ptr<IcyDemuxer> demuxer;
+    int stream_timer;
+    unsigned long long upstream_bytes;
+    unsigned long long blocks;
+    // Numbers given to the next audio block and its first AUDIO_SEQ datagram.
+    uint32_t next_block;
+    uint32_t next_datagram;
+    // Whether audio is spliced from the socket to the standard output.
+    bool splice;
+    // Pipeline of the station, specialized for its metadata mode and sink.
+    Relay relay;
+    // Ring receiving the stream, null with epoll, or once the kernel refused multishot receives.
+    IoUring *ring;
+    // Counts connections read through the ring, so that completions of a lost one are told apart.
+    uint32_t generation;
+
+    // Whether a failed connection is replaced rather than ending the proxy.
+    bool failover;
+    // Whether the connection was lost and waits to be replaced, since @lost_at.
+    bool lost;
+    long long lost_at;
+    // Connection which takes over from the current one, with the index of its server.
+    unique_ptr<UpstreamConnection> spare;
+    size_t spare_source;
+    // Server the next spare connects to.
+    size_t next_source;
+    // Spare connections which failed since one got ready.
+    size_t failed_in_row;
+    int spare_timer;
+    int failover_timer;
+    unsigned long long switches;
+    unsigned long long reconnects;
+    unsigned long long reconnects_failed;
+    long long switched_at;
+    long long switch_usec;
+
+    // Proxy the station is relayed from, instead of a server.
+    unique_ptr<ParentProxy> parent;
+    Forward forward;
+
+    Station(size_t index, station_params source, const vector<station_params> &mirrors, int metadata)
+        : index(index), sources(1, source), metadata(metadata), sock(-1), stream_timer(-1),
+          upstream_bytes(0), blocks(0), next_block(0), next_datagram(0), splice(false),
+          relay(nullptr), ring(nullptr), generation(0), failover(false), lost(false), lost_at(0),
+          spare_source(0), next_source(0), failed_in_row(0), spare_timer(-1), failover_timer(-1),
+          switches(0), reconnects(0), reconnects_failed(0), switched_at(0), switch_usec(0),
+          forward(nullptr) {
+        sources.insert(sources.end(), mirrors.begin(), mirrors.end());
+        next_source = 1 % sources.size();
     }
 };
 
-// Checks which clients are active and remove the inactive ones.
-void check_alive(map<string, Client> &client_map, int timeout) {
-    vector<string> to_remove;
-    for (auto it = client_map.begin(); it != client_map.end(); it++) {
-        if (microseconds_passed_from(it->second.last_message) > timeout * 1000000) {
-            to_remove.push_back(it->first);
-        }
-    }
-
-    for (auto rem : to_remove) {
-        client_map.erase(rem);
-    }
+// Checks if the standard output is a pipe, so that audio can be spliced into it.
+bool stdout_is_pipe() {
+    struct stat info;
+    return fstat(STDOUT_FILENO, &info) == 0 && S_ISFIFO(info.st_mode);
 }
 
-// Sends message to all clients.
-void write_to_all(map<string, Client> &client_map, int sock, string &data, unsigned type) {
-    for (auto client : client_map) {
-        udp_write(sock, data, &client.second.sock_address, type);
+// Writes the viewed bytes to a given file.
+void write_span(const RingSpan &data, FILE *file) {
+    for (int i = 0; i < 2; i++) {
+        fwrite(data.part[i], sizeof(char), data.part_size[i], file);
     }
 }
 
 // Initializes connection with server and reads header.
+// Clears @metadata if the server does not send it.
 // Returns a tuple containing a beginning of stream, radio name and metaint.
-tuple<string, string, int> initialize_connection(proxy_params &params, int sock) {
+tuple<string, string, int> initialize_connection(station_params &source, int &metadata,
+        int timeout, int sock) {
     ssize_t rcv_len;
 
-    // Prepare and send the GET request.
-    string message = "GET " + params.resource + " HTTP/1.1\r\n";
-    message += "Host: " + params.host + "\r\n";
-    message += "Icy-MetaData:" + to_string(params.metadata) + "\r\n\r\n";
+    // Send the GET request.
+    tcp_write(sock, stream_request(source, metadata));
 
-    tcp_write(sock, message);
-
-    string header = "";
+    IcyHeaderParser header;
+    string response_beginning = "";
 
     // Read the header.
-    while (header.find("\r\n\r\n") == string::npos) {
-        int radio_in = sock, agent_in = -1;
-        int events = custom_select(radio_in, agent_in, time_left(time_now(), params.timeout));
+    while (!header.done()) {
+        int events = wait_for_input(sock, time_left(time_now(), timeout));
 
         if (events == 0) {
             fatal("Connection lost");
@@ -99,206 +171,620 @@ tuple<string, string, int> initialize_connection(proxy_params &params, int sock)
             fatal("Connection terminated");
         }
 
-        header += read_part;
+        size_t header_part = header.feed(read_part.data(), read_part.size());
+        response_beginning = read_part.substr(header_part);
     }
 
-    int header_len = header.find("\r\n\r\n");
+    // Get metaint and radio name.
+    string error;
+    int metaint = stream_metaint(header, metadata, error);
+    if (metaint == 0) {
+        fatal(error.c_str());
+    }
+
+    string radio_name = header.has_name() ? header.name() : default_radio_name;
+
+    return make_tuple(response_beginning, radio_name, metaint);
+}
 
-    transform(header.begin(), header.end(), header.begin(), ::toupper);
+// Writes audio of a station to the standard output and metadata to the standard error.
+struct StdoutSink {
+    StdoutSink(Station &, proxy_params &, vector<unique_ptr<Shard>> &, long long) {}
 
-    if (header.find("ICY 200 OK") != 0 &&
-        header.find("HTTP/1.0 200 OK") != 0 &&
-        header.find("HTTP/1.1 200 OK") != 0) {
-        fatal("Response status differs from 200 OK");
+    void audio(const RingSpan &data) {
+        write_span(data, stdout);
     }
 
-    // Get metaint and radio name.
-    int metaint = default_package_size;
-    const string METAINT = "ICY-METAINT:";
-    unsigned long metaint_location = header.find(METAINT);
-    if (params.metadata && metaint_location != string::npos) {
-        metaint = atoi(header.c_str() + metaint_location + METAINT.size());
-    } else if (params.metadata) {
-        params.metadata = false;
-    } else if (metaint_location != string::npos) {
-        fatal("Server forces metadata");
+    void metadata(const RingSpan &data) {
+        write_span(data, stderr);
     }
+};
 
-    string radio_name = "";
-    const string NAME = "ICY-NAME:";
-    unsigned long name_location = header.find(NAME);
-    if (name_location == string::npos) {
-        radio_name = default_radio_name;
-    } else {
-        for (int i = name_location + NAME.size(); header[i] != '\r'; i++) {
-            radio_name += header[i];
+// Publishes blocks of a station to the shards, which send them to agents and groups.
+// With @Parity, audio blocks carry their FEC messages.
+template <bool Parity>
+struct ShardSink {
+    Station &station;
+    proxy_params &params;
+    vector<unique_ptr<Shard>> &shards;
+    long long received;
+
+    ShardSink(Station &station, proxy_params &params, vector<unique_ptr<Shard>> &shards,
+              long long received)
+        : station(station), params(params), shards(shards), received(received) {}
+
+    void audio(const RingSpan &data) {
+        Block *numbered = new Block{station.index, AUDIO, data.to_string(), received, 0, 0, {}};
+        // Every shard numbers the datagrams of a block the same way, so the numbers are picked here.
+        numbered->number = station.next_block++;
+        numbered->first_datagram = station.next_datagram;
+        station.next_datagram += udp_fragments(data.size(), true);
+        // Parity is the same for every client, so it is computed once here.
+        if (Parity) {
+            AudioSequence sequence = AudioSequence();
+            sequence.block = numbered->number;
+            sequence.timestamp = received / 1000;
+            numbered->parity = encode_parity(numbered->data, sequence, params.fec_group);
         }
+        publish(numbered);
     }
 
-    // Calculate the beginning of the stream.
-    string response_beginning = "";
-    for (int i = header_len + 4; i < (int)header.size(); i++) {
-        response_beginning += header[i];
+    void metadata(const RingSpan &data) {
+        // Empty metadata is not worth sending.
+        if (data.size() <= 1)
+            return;
+        publish(new Block{station.index, METADATA, data.to_string(), received, 0, 0, {}});
     }
 
-    return make_tuple(response_beginning, radio_name, metaint);
+    void publish(Block *block) {
+        shared_ptr<const Block> shared(block);
+        for (auto &shard : shards) {
+            shard->publish(shared);
+        }
+    }
+};
+
+// Sends all complete audio packages and metadata pieces gathered by the demuxer
+// of a station to @Sink.
+template <bool Metadata, class Sink>
+void relay(Station &station, proxy_params &params, vector<unique_ptr<Shard>> &shards,
+        long long received) {
+    Sink sink(station, params, shards, received);
+    station.blocks += relay_blocks<Metadata>(*station.demuxer, sink);
 }
 
-// Decides if a package should be send to the clients.
-// Depending on the decision, send it and modifies package string, or does no changes.
-// Gets information if current data is metadata or audio.
-void send_package_if_necessary(string &package, int metaint, bool &metadata_now, proxy_params &params,
-        map<string, Client> &client_map, int agent_sock, string &last_metadata) {
-    // Repeats the action while it's possible that an audio package/matadata piece is ready.
-    while ((int)package.size() >= metaint || metadata_now) {
-        int ps = package.size();
-        if (metadata_now) {
-            if (!params.metadata) {
-                metadata_now = false;
-            } else if (ps == 0) {
-                break;
-            } else {
-                unsigned char first = package[0];
-                if (ps <= 16 * first)
-                    break;
-
-                string metadata(1, package[0]);
-                string new_package = "";
-
-                for (int i = 1; i <= 16 * first; i++) {
-                    metadata += package[i];
-                }
-                for (int i = 16 * first + 1; i < ps; i++) {
-                    new_package += package[i];
-                }
-
-                package = new_package;
-                metadata_now = false;
-
-                if (params.agent_active) {
-                    if (first != 0) {
-                        write_to_all(client_map, agent_sock, metadata, METADATA);
-                        last_metadata = metadata;
-                    }
-                } else {
-                    fwrite(metadata.c_str(), sizeof(char), metadata.size(), stderr);
-                }
-            }
+// Picks the pipeline of a station with metadata mode @Metadata.
+template <bool Metadata>
+Relay pick_relay(const proxy_params &params) {
+    if (!params.agent_active)
+        return relay<Metadata, StdoutSink>;
+    if (params.fec_group > 0)
+        return relay<Metadata, ShardSink<true>>;
+    return relay<Metadata, ShardSink<false>>;
+}
+
+// Picks the pipeline of a station, once its metadata mode is known.
+Relay pick_relay(const Station &station, const proxy_params &params) {
+    return station.metadata ? pick_relay<true>(params) : pick_relay<false>(params);
+}
+
+// Prints counters of the block queue of a given shard.
+void print_queue_stats(size_t shard, const QueueStats &stats, size_t depth) {
+    cerr << "Shard " << shard << " queue: " << stats.pushed << " blocks, depth " << depth
+         << " (max " << stats.max_depth << "), full " << stats.full << " times\n";
+}
+
+// Sends a block a station got from its parent proxy to @Sink.
+template <class Sink>
+void forward(Station &station, proxy_params &params, vector<unique_ptr<Shard>> &shards,
+        uint16_t type, const RingSpan &data, long long received) {
+    Sink sink(station, params, shards, received);
+    if (type == METADATA)
+        sink.metadata(data);
+    else
+        sink.audio(data);
+    station.blocks++;
+}
+
+// Picks where blocks of stations relayed from another proxy go.
+Forward pick_forward(const proxy_params &params) {
+    if (!params.agent_active)
+        return forward<StdoutSink>;
+    if (params.fec_group > 0)
+        return forward<ShardSink<true>>;
+    return forward<ShardSink<false>>;
+}
+
+// Prints send queue counters of all shards together.
+void print_send_queue_stats(const SendQueueStats &stats) {
+    cerr << "Send queues: " << stats.dropped << " blocks dropped, max depth " << stats.max_depth << "\n";
+}
+
+// Prints pacing counters of all shards together.
+void print_pacing_stats(const PacingStats &stats) {
+    cerr << "Pacing: " << stats.blocks << " blocks, " << stats.dropped << " sends dropped, "
+         << "max queue " << stats.max_queue << " blocks\n";
+}
+
+// Prints the latency histogram of all shards.
+void print_latency(const LiveStats &live) {
+    LatencyHistogram latency;
+    live.total_latency(latency);
+    cerr << "Latency from upstream to agents: " << latency_summary(latency) << "\n";
+}
+
+// Prints failover counters of the stations which have it.
+void print_failover_stats(const vector<unique_ptr<Station>> &stations) {
+    for (auto &station : stations) {
+        if (!station->failover)
+            continue;
+        cerr << "Station " << station->index << " failover: " << station->switches << " switches";
+        if (station->switches > 0)
+            cerr << " (last took " << station->switch_usec << "us)";
+        cerr << ", " << station->reconnects << " connections opened, " << station->reconnects_failed
+             << " failed\n";
+    }
+}
+
+// Prints the hop counters of the stations relayed from other proxies.
+void print_relay_stats(const vector<unique_ptr<Station>> &stations) {
+    for (auto &station : stations) {
+        if (!station->parent)
+            continue;
+        const HopStats &hop = station->parent->hop_stats();
+        const ReorderStats &reorder = station->parent->reorder_stats();
+        cerr << "Station " << station->index << " relayed at level " << hop.level << ": round trip "
+             << hop.rtt_usec << "us, path latency " << hop.path_latency_usec << "us, "
+             << reorder.blocks << " blocks, " << reorder.dropped_blocks << " dropped, "
+             << reorder.lost_datagrams << " datagrams lost, " << reorder.recovered << " recovered, "
+             << hop.rediscovers << " rediscovers\n";
+    }
+}
+
+// Takes action after @bytes bytes of the stream of a station were stored in its demuxer.
+void upstream_received(Station &station, size_t bytes, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    long long now = now_usec();
+    station.upstream_bytes += bytes;
+    live.package_received(now);
+    reactor.arm_timer(station.stream_timer, params.timeout * 1000000ll);
+
+    station.relay(station, params, shards, now);
+}
+
+// Notes that the connection of a station failed for @reason. Without failover the
+// proxy exits, otherwise the connection is replaced by failover_step.
+void lose_upstream(Station &station, Reactor &reactor, const char *reason) {
+    if (!station.failover)
+        fatal(reason);
+    if (station.lost)
+        return;
+    station.lost = true;
+    station.lost_at = now_usec();
+    reactor.timers().cancel(station.stream_timer);
+    // Handlers must not remove themselves, so the connection is dropped from the loop.
+    reactor.arm_timer(station.failover_timer, 0);
+}
+
+// Reads everything the server of a station sent, moving audio straight from the
+// socket to the standard output pipe with splice. Only metadata, and audio which
+// was read along with the header, goes through the demuxer.
+void splice_upstream(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    while (true) {
+        size_t audio = station.demuxer->audio_to_come();
+        ssize_t rcv_len;
+        if (audio > 0) {
+            // Audio written through stdout before has to come out first.
+            fflush(stdout);
+            rcv_len = splice(station.sock, nullptr, STDOUT_FILENO, nullptr, audio, SPLICE_F_MOVE);
         } else {
-            string new_package = "";
-            for (int i = metaint; i < ps; i++)
-                new_package += package[i];
-
-            package.resize(metaint);
-            if (params.agent_active) {
-                write_to_all(client_map, agent_sock, package, AUDIO);
-            } else {
-                fwrite(package.c_str(), sizeof(char), metaint, stdout);
-            }
+            rcv_len = station.demuxer->buffer().read_from(station.sock, station.demuxer->metadata_to_come());
+        }
+
+        if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (rcv_len < 0) {
+            syserr(audio > 0 ? "splice" : "read");
+        } else if (rcv_len == 0) {
+            fatal("Connection terminated");
+        }
 
-            package = new_package;
-            metadata_now = true;
+        if (audio > 0)
+            station.demuxer->skip_audio(rcv_len);
+        upstream_received(station, rcv_len, params, reactor, shards, live);
+    }
+}
+
+// Reads everything the server of a station sent and takes action.
+void read_upstream(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    while (true) {
+        ssize_t rcv_len = station.demuxer->buffer().read_from(station.sock);
+
+        if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (rcv_len < 0) {
+            if (!station.failover)
+                syserr("read");
+            lose_upstream(station, reactor, strerror(errno));
+            break;
+        } else if (rcv_len == 0) {
+            lose_upstream(station, reactor, "Connection terminated");
+            break;
         }
+
+        upstream_received(station, rcv_len, params, reactor, shards, live);
     }
 }
 
-// Reads a message from any agent and responds in a right way.
-void agent(int sock, map<string, Client> &client_map, string &radio_name, string last_metadata) {
-    sockaddr_in sender_address;
-    string message;
-    uint16_t type;
+// Asks @ring to receive the stream of a station into provided buffers,
+// for as long as the connection lasts.
+void arm_upstream_recv(IoUring &ring, Station &station) {
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = station.sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = upstream_buffer_group;
+    sqe->user_data = station.index | (uint64_t)station.generation << 32;
+    ring.submit();
+}
 
-    ssize_t rcv_len = udp_read(sock, message, &sender_address, type);
-    string char_address = get_address_string(sender_address);
+// Starts reading the connection of a station, which is non-blocking by now.
+void watch_upstream(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    if (station.ring) {
+        arm_upstream_recv(*station.ring, station);
+        return;
+    }
+    if (station.splice) {
+        // The beginning of the stream came with the header, it goes out first.
+        station.relay(station, params, shards, now_usec());
+        reactor.add(station.sock, EPOLLIN, [&station, &params, &reactor, &shards, &live](uint32_t) {
+            splice_upstream(station, params, reactor, shards, live);
+        });
+        return;
+    }
+    reactor.add(station.sock, EPOLLIN, [&station, &params, &reactor, &shards, &live](uint32_t) {
+        read_upstream(station, params, reactor, shards, live);
+    });
+}
 
-    if (rcv_len >= 0) {
-        if (type == DISCOVER) {
-            udp_write(sock, radio_name, &sender_address, IAM);
-            if (last_metadata != "") {
-                udp_write(sock, last_metadata, &sender_address, METADATA);
-            }
-            client_map[char_address] = Client(sender_address);
-        } else if (type == KEEPALIVE) {
-            if (client_map.count(char_address)) {
-                client_map[char_address].update_time();
+// Handles all completed upstream receives of @ring.
+void upstream_completions(IoUring &ring, vector<unique_ptr<Station>> &stations, proxy_params &params,
+        Reactor &reactor, vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    io_uring_cqe cqe;
+    while (ring.pop_cqe(cqe)) {
+        Station &station = *stations[(uint32_t)cqe.user_data];
+        // Data of a lost connection is not relayed.
+        if (cqe.user_data >> 32 != station.generation || station.lost || !station.ring) {
+            if (cqe.res > 0)
+                ring.recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            continue;
+        }
+
+        if (cqe.res == -EINVAL) {
+            // Buffer rings came with Linux 5.19, multishot receives only with 6.0.
+            // Nothing was received yet, so the station is read with epoll from here on.
+            cerr << "io_uring multishot receive is not available, reading upstream with epoll\n";
+            station.ring = nullptr;
+            watch_upstream(station, params, reactor, shards, live);
+            continue;
+        } else if (cqe.res == 0) {
+            lose_upstream(station, reactor, "Connection terminated");
+            continue;
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+            errno = -cqe.res;
+            if (!station.failover)
+                syserr("recv");
+            lose_upstream(station, reactor, strerror(errno));
+            continue;
+        }
+
+        if (cqe.res > 0) {
+            uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            const char *data = ring.provided_buffer(id);
+            size_t left = cqe.res;
+            // A buffer may hold more than fits next to a partial block, so it is
+            // copied in parts, and complete blocks are taken out in between.
+            while (left > 0) {
+                size_t part = min(left, station.demuxer->buffer().free_space());
+                station.demuxer->buffer().append(data, part);
+                upstream_received(station, part, params, reactor, shards, live);
+                data += part;
+                left -= part;
             }
-        } else {
-            cerr << "Unknown type\n";
+            ring.recycle_buffer(id);
         }
+
+        // The receive stops after an error or when it ran out of buffers.
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_upstream_recv(ring, station);
+    }
+}
+
+// Stops reading the lost connection of a station and closes it.
+void drop_upstream(Station &station, Reactor &reactor) {
+    if (station.ring) {
+        // The receive ends with the connection, and its last completions
+        // are told apart by the old generation.
+        station.generation++;
+        shutdown(station.sock, SHUT_RDWR);
     } else {
-        cerr << "Incorrect UDP header\n";
+        reactor.remove(station.sock);
     }
+    close_socket(station.sock);
+    station.sock = -1;
 }
 
-// Main proxy functionality.
-void proxy(proxy_params &params) {
-    int sock = create_connected_socket(params.host, params.port);
-    ssize_t rcv_len;
+// Opens a spare connection of a station to its next server.
+void start_spare(Station &station, proxy_params &params, Reactor &reactor) {
+    station.spare_source = station.next_source;
+    station.next_source = (station.next_source + 1) % station.sources.size();
+    station.reconnects++;
+    station.spare.reset(new UpstreamConnection(reactor, station.spare_timer,
+            station.resolved[station.spare_source], params.metadata, params.timeout,
+            [&station, &reactor]() {
+                station.failed_in_row = 0;
+                if (station.lost)
+                    reactor.arm_timer(station.failover_timer, 0);
+            },
+            [&station, &reactor]() {
+                station.reconnects_failed++;
+                station.failed_in_row++;
+                // After a loss every server is tried at once, then they are given a break.
+                bool now = station.lost && station.failed_in_row < station.sources.size();
+                reactor.arm_timer(station.failover_timer, now ? 0 : reconnect_delay);
+            }));
+}
 
-    string package, radio_name;
-    int metaint;
+// Makes the ready spare connection of a station the one relaying it. The spare
+// has dropped whole blocks only, so the stream goes on from a block boundary.
+void promote_spare(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    station.sock = station.spare->take(station.demuxer, station.metadata);
+    station.spare.reset();
+    station.relay = pick_relay(station, params);
+
+    long long now = now_usec();
+    station.lost = false;
+    station.switches++;
+    station.switched_at = now;
+    station.switch_usec = now - station.lost_at;
+
+    reactor.arm_timer(station.stream_timer, params.timeout * 1000000ll);
+    watch_upstream(station, params, reactor, shards, live);
+}
 
-    tie(package, radio_name, metaint) = initialize_connection(params, sock);
+// Moves the failover of a station on: drops a lost connection and a failed spare,
+// puts a ready spare in place of a lost connection, and opens a spare if one is needed.
+void failover_step(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    if (station.lost && station.sock >= 0)
+        drop_upstream(station, reactor);
+    if (station.spare && station.spare->has_failed())
+        station.spare.reset();
+    if (station.lost && station.spare && station.spare->is_ready())
+        promote_spare(station, params, reactor, shards, live);
+    if (!station.spare && (station.lost || params.standby))
+        start_spare(station, params, reactor);
+}
 
-    // Initiates the agent socket.
-    int agent_sock = -1;
-    ip_mreq ip_mreq;
-    if (params.agent_active) {
-        auto res = create_multicast_socket(params.multicast_address, params.agent_port);
-        agent_sock = res.first;
-        ip_mreq = res.second;
-    }
-    map<string, Client> client_map;
+// Connects a station to its server and starts relaying its stream,
+// through @ring if it's not null.
+void start_station(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live, IoUring *ring) {
+    station_params &source = station.sources[0];
+    station.sock = create_connected_socket(source.host, source.port, params.timeout);
 
+    string package;
+    int metaint;
 
-    bool metadata_now = false;
-    timeval last_stream_package = time_now();
-    string last_metadata = "";
+    tie(package, station.radio_name, metaint) = initialize_connection(source,
+            station.metadata, params.timeout, station.sock);
+
+    station.ring = ring;
+    station.failover = params.standby || station.sources.size() > 1;
+    // A replaced connection has to start at a block boundary, which splice does not keep.
+    station.splice = params.splice && !params.agent_active && !ring && !station.failover
+            && stdout_is_pipe();
+    station.demuxer.reset(new IcyDemuxer(metaint, station.metadata, station.splice));
+    station.demuxer->buffer().append(package.c_str(), package.size());
+    station.relay = pick_relay(station, params);
+
+    // Fires if the server was silent for too long.
+    station.stream_timer = reactor.create_timer([&station, &reactor]() {
+        lose_upstream(station, reactor, "Connection terminated or lost");
+    });
+    reactor.arm_timer(station.stream_timer, params.timeout * 1000000ll);
+
+    if (station.failover) {
+        for (const station_params &source : station.sources)
+            station.resolved.push_back(resolve_source(source));
+        station.spare_timer = reactor.create_timer([&station]() {
+            if (station.spare)
+                station.spare->expired();
+        });
+        station.failover_timer = reactor.create_timer([&station, &params, &reactor, &shards, &live]() {
+            failover_step(station, params, reactor, shards, live);
+        });
+        if (params.standby)
+            start_spare(station, params, reactor);
+    }
 
-    // Main program loop.
-    while (!finish_program) {
+    set_nonblocking(station.sock);
+    watch_upstream(station, params, reactor, shards, live);
+}
 
-        int radio_in = sock, agent_in = agent_sock;
-        int events = custom_select(radio_in, agent_in, time_left(last_stream_package, params.timeout));
+// Registers a station with its parent proxy and starts relaying its stream.
+void start_relayed_station(Station &station, proxy_params &params, Reactor &reactor,
+        vector<unique_ptr<Shard>> &shards, LiveStats &live) {
+    station.forward = pick_forward(params);
+    station.parent.reset(new ParentProxy(reactor, station.sources[0], params.timeout,
+            [&station, &params, &shards, &live](uint16_t type, const RingSpan &data, long long received) {
+                station.upstream_bytes += data.size();
+                live.package_received(received);
+                station.forward(station, params, shards, type, data, received);
+            }));
+    station.radio_name = station.parent->radio_name();
+}
 
-        if (events == 0) {
-            fatal("Connection terminated or lost");
-        } else if (events == -1) {
-            finish_program = true;
+// Main proxy functionality.
+void proxy(proxy_params &params) {
+    Reactor reactor;
+    vector<unique_ptr<Shard>> shards;
+
+    // The ingest thread is part 0, the shards follow.
+    LiveStats live(1 + (params.agent_active ? params.shards : 0), now_usec());
+
+    // SIGUSR1 asks for the latency histogram. It is blocked in all threads,
+    // including the shards started later, and taken from a signalfd by the main loop.
+    sigset_t dump_signals;
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump_signals, nullptr);
+    int dump_fd = signalfd(-1, &dump_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (dump_fd < 0)
+        syserr("signalfd");
+    reactor.add(dump_fd, EPOLLIN, [&live, dump_fd](uint32_t) {
+        signalfd_siginfo info;
+        while (read(dump_fd, &info, sizeof info) == sizeof info)
+            print_latency(live);
+    });
+
+    // With io_uring, the shards use it too, unless the kernel does not allow it.
+    unique_ptr<IoUring> ring;
+    if (params.io_uring) {
+        ring = IoUring::open(upstream_ring_entries);
+        if (ring && !ring->provide_buffers(upstream_buffer_group, upstream_buffers, upstream_buffer_size))
+            ring.reset();
+        if (!ring) {
+            cerr << "io_uring is not available, falling back to epoll\n";
+            params.io_uring = false;
         }
+    }
 
-        // If a message from server came, read it and take action.
-        if (radio_in == 1) {
-            string read_string;
-            rcv_len = tcp_read(sock, read_string);
-
-            if (rcv_len < 0) {
+    vector<unique_ptr<Station>> stations;
+    for (size_t i = 0; i < params.stations.size(); i++) {
+        stations.emplace_back(new Station(i, params.stations[i], params.mirrors[i], params.metadata));
+        start_station(*stations.back(), params, reactor, shards, live, ring.get());
+    }
+    for (auto &parent : params.parents) {
+        stations.emplace_back(new Station(stations.size(), parent, {}, params.metadata));
+        start_relayed_station(*stations.back(), params, reactor, shards, live);
+    }
+    if (ring) {
+        int ring_fd = ring->event_fd();
+        reactor.add(ring_fd, EPOLLIN, [&, ring_fd](uint32_t) {
+            uint64_t count;
+            if (read(ring_fd, &count, sizeof count) < 0 && errno != EAGAIN)
                 syserr("read");
-            } else if (rcv_len == 0) {
-                fatal("Connection terminated");
+            upstream_completions(*ring, stations, params, reactor, shards, live);
+        });
+    }
+
+    // Publishes the totals of the upstream side for STATS reports.
+    int stats_timer = reactor.create_timer([&]() {
+        StatsTotals totals = StatsTotals();
+        long long switched_at = 0;
+        for (auto &station : stations) {
+            totals.upstream_bytes += station->upstream_bytes;
+            totals.blocks += station->blocks;
+            totals.upstream_switches += station->switches;
+            totals.upstream_reconnects += station->reconnects;
+            totals.upstream_reconnects_failed += station->reconnects_failed;
+            if (station->switches > 0 && station->switched_at > switched_at) {
+                switched_at = station->switched_at;
+                totals.upstream_switch_usec = station->switch_usec;
+            }
+            if (!station->parent)
+                continue;
+            // The deepest hop tells where the proxy is in the tree.
+            const HopStats &hop = station->parent->hop_stats();
+            const ReorderStats &reorder = station->parent->reorder_stats();
+            if (hop.level > (long long)totals.relay_level) {
+                totals.relay_level = hop.level;
+                totals.relay_hop_rtt_usec = hop.rtt_usec;
+                totals.relay_path_latency_usec = hop.path_latency_usec;
             }
+            totals.relay_lost_datagrams += reorder.lost_datagrams;
+            totals.relay_dropped_blocks += reorder.dropped_blocks;
+            totals.relay_recovered += reorder.recovered;
+        }
+        live.update(0, totals, now_usec());
+        reactor.arm_timer(stats_timer, stats_period);
+    });
+    reactor.arm_timer(stats_timer, stats_period);
 
-            package += read_string;
-            last_stream_package = time_now();
+    // Initiates the shards serving agents.
+    vector<StationInfo> station_info;
+    if (params.agent_active) {
+        set_max_payload(params.max_payload);
+        if (params.gso)
+            enable_gso();
 
-            send_package_if_necessary(package, metaint, metadata_now, params, client_map, agent_sock, last_metadata);
+        for (size_t i = 0; i < stations.size(); i++) {
+            station_info.push_back(StationInfo{stations[i]->radio_name, i == 0 ? params.agent_port : 0});
+        }
+        for (int i = 0; i < params.shards; i++) {
+            shards.emplace_back(new Shard(i, shards, station_info, params, live));
         }
 
-        // If a message from a client came, read it and respond.
-        if (agent_in == 1 && params.agent_active) {
-            agent(agent_sock, client_map, radio_name, last_metadata);
-        } else if (params.agent_active) {
-            check_alive(client_map, params.timeout);
+        // Only the main thread handles signals.
+        sigset_t signals, old_signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+        for (auto &shard : shards) {
+            shard->start();
         }
+        pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+    }
+
+    // Main program loop.
+    reactor.run(finish_program);
+
+    FanoutStats fanout_stats = FanoutStats();
+    PacingStats pacing_stats = PacingStats();
+    SendQueueStats queue_stats = SendQueueStats();
+    for (size_t i = 0; i < shards.size(); i++) {
+        print_queue_stats(i, shards[i]->queue_stats(), shards[i]->queue_depth());
+    }
+    for (auto &shard : shards) {
+        shard->stop();
+        fanout_stats.blocks += shard->fanout_stats().blocks;
+        fanout_stats.datagrams += shard->fanout_stats().datagrams;
+        fanout_stats.syscalls += shard->fanout_stats().syscalls;
+        fanout_stats.stalls += shard->fanout_stats().stalls;
+        fanout_stats.errors += shard->fanout_stats().errors;
+        queue_stats.dropped += shard->send_queue_stats().dropped;
+        queue_stats.max_depth = max(queue_stats.max_depth, shard->send_queue_stats().max_depth);
+
+        PacingStats pacing = shard->pacing_stats();
+        pacing_stats.blocks += pacing.blocks;
+        pacing_stats.dropped += pacing.dropped;
+        pacing_stats.max_queue = max(pacing_stats.max_queue, pacing.max_queue);
     }
 
-    if (params.multicast_address != "" && params.agent_active) {
-        close_multicast_socket(agent_sock, ip_mreq);
-    } else if (params.agent_active) {
-        close_socket(agent_sock);
+    print_reactor_stats(reactor.stats());
+    print_failover_stats(stations);
+    print_relay_stats(stations);
+    if (params.agent_active) {
+        print_fanout_stats(fanout_stats);
+        print_send_queue_stats(queue_stats);
+        if (params.pacing)
+            print_pacing_stats(pacing_stats);
+        print_latency(live);
     }
-    close_socket(sock);
 
+    shards.clear();
+    close_socket(dump_fd);
+    for (auto &station : stations) {
+        // A lost connection is closed already.
+        if (station->sock >= 0)
+            close_socket(station->sock);
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -308,5 +794,3 @@ int main(int argc, char *argv[]) {
 
     proxy(params);
 }
-
-
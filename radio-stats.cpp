@@ -0,0 +1,42 @@
+#include <iostream>
+#include <tuple>
+
+#include "err.h"
+#include "live_stats.h"
+#include "network.h"
+#include "parser.h"
+#include "socket_manager.h"
+
+using namespace std;
+
+void print_usage() {
+    cerr << "Usage: ./radio-stats -H host -P port [-T timeout]" << endl;
+    exit(1);
+}
+
+// Asks a running radio-proxy for its numbers and prints them.
+int main(int argc, char *argv[]) {
+    stats_params params = parse_stats_params(argc, argv, print_usage);
+
+    int sock;
+    sockaddr_in proxy_address;
+    tie(sock, proxy_address) = poll_multicast_socket(params.host, params.port);
+
+    udp_write(sock, "", &proxy_address, STATS);
+
+    // A report longer than the largest payload of the proxy comes in many datagrams.
+    string report;
+    timeval timeout = {params.timeout, 0};
+    while (!report_complete(report)) {
+        if (wait_for_input(sock, timeout) <= 0)
+            fatal(report.empty() ? "No reply" : "Incomplete reply");
+
+        string reply;
+        uint16_t type;
+        if (udp_read(sock, reply, nullptr, type) >= 0 && type == STATS)
+            report += reply;
+    }
+    cout << report;
+
+    close_socket(sock);
+}
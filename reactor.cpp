@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <unistd.h>
+
+#include "err.h"
+#include "my_time.h"
+#include "reactor.h"
+
+using namespace std;
+
+namespace {
+    const int max_events = 64;
+    const long long timer_tick = 1000;
+}
+
+Reactor::Reactor() : wheel(timer_tick, now_usec()), counters() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        syserr("epoll_create1");
+    counters.started_usec = now_usec();
+}
+
+Reactor::~Reactor() {
+    close(epoll_fd);
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+    epoll_event event = {};
+    event.events = events | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        syserr("epoll_ctl");
+    handlers[fd] = handler;
+}
+
+void Reactor::remove(int fd) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) < 0)
+        syserr("epoll_ctl");
+    handlers.erase(fd);
+}
+
+void Reactor::arm_timer(int timer, long long usec) {
+    wheel.schedule(timer, now_usec() + usec);
+}
+
+void Reactor::run(const bool &finish) {
+    epoll_event events[max_events];
+
+    while (!finish) {
+        long long timeout = wheel.next_timeout(now_usec());
+        int timeout_ms = timeout < 0 ? -1 : (timeout + 999) / 1000;
+
+        int ready = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+        if (ready < 0) {
+            if (errno != EINTR)
+                syserr("epoll_wait");
+            continue;
+        }
+
+        long long woken = now_usec();
+        counters.wakeups++;
+        counters.events += ready;
+
+        for (int i = 0; i < ready; i++) {
+            // A handler may have removed a descriptor reported in the same batch.
+            auto it = handlers.find(events[i].data.fd);
+            if (it != handlers.end())
+                it->second(events[i].events);
+        }
+        wheel.advance(now_usec());
+
+        long long busy = now_usec() - woken;
+        counters.busy_usec += busy;
+        counters.max_busy_usec = max(counters.max_busy_usec, busy);
+    }
+}
+
+void print_reactor_stats(const ReactorStats &stats) {
+    long long elapsed = max(now_usec() - stats.started_usec, 1ll);
+    unsigned long long wakeups = max(stats.wakeups, 1ull);
+    cerr << "Reactor: " << stats.wakeups << " wakeups (" << stats.wakeups * 1000000 / elapsed
+         << "/s), " << stats.events << " events, loop latency avg " << stats.busy_usec / wakeups
+         << "us max " << stats.max_busy_usec << "us\n";
+}
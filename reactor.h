@@ -0,0 +1,68 @@
+#ifndef DUZE_REACTOR_H
+#define DUZE_REACTOR_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <sys/epoll.h>
+
+#include "timer_wheel.h"
+
+// Counters describing the work done by the event loop.
+struct ReactorStats {
+    unsigned long long wakeups;
+    unsigned long long events;
+    long long busy_usec;
+    long long max_busy_usec;
+    long long started_usec;
+};
+
+// Edge-triggered epoll event loop with a timer wheel.
+// Handlers are called with the ready events and must drain their descriptor,
+// as readiness is reported only once per change. A handler must not remove itself.
+class Reactor {
+public:
+    typedef std::function<void(uint32_t)> Handler;
+
+    Reactor();
+
+    ~Reactor();
+
+    // Starts watching descriptor @fd for @events.
+    void add(int fd, uint32_t events, Handler handler);
+
+    // Stops watching descriptor @fd. Does not close it.
+    void remove(int fd);
+
+    // Creates a timer calling @callback when it expires. Returns its id.
+    // The timer is disarmed until arm_timer is called.
+    int create_timer(std::function<void()> callback) {
+        return wheel.create(callback);
+    }
+
+    // Makes timer @timer expire once, after @usec microseconds.
+    void arm_timer(int timer, long long usec);
+
+    // The timer wheel driven by this loop.
+    TimerWheel &timers() {
+        return wheel;
+    }
+
+    // Dispatches events until @finish becomes true.
+    void run(const bool &finish);
+
+    const ReactorStats &stats() const {
+        return counters;
+    }
+
+private:
+    int epoll_fd;
+    std::map<int, Handler> handlers;
+    TimerWheel wheel;
+    ReactorStats counters;
+};
+
+// Prints a summary of reactor counters to stderr.
+void print_reactor_stats(const ReactorStats &stats);
+
+#endif //DUZE_REACTOR_H
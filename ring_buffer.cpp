@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cstring>
+#include <sys/uio.h>
+
+#include "err.h"
+#include "ring_buffer.h"
+
+using namespace std;
+
+RingSpan RingSpan::sub(size_t offset, size_t length) const {
+    RingSpan result;
+    int parts = 0;
+    for (int i = 0; i < 2 && length > 0; i++) {
+        if (offset >= part_size[i]) {
+            offset -= part_size[i];
+            continue;
+        }
+        size_t taken = min(length, part_size[i] - offset);
+        result.part[parts] = part[i] + offset;
+        result.part_size[parts] = taken;
+        parts++;
+        length -= taken;
+        offset = 0;
+    }
+    return result;
+}
+
+string RingSpan::to_string() const {
+    string result;
+    result.reserve(size());
+    for (int i = 0; i < 2; i++)
+        result.append(part[i], part_size[i]);
+    return result;
+}
+
+void RingSpan::copy(size_t offset, size_t length, char *out) const {
+    RingSpan bytes = sub(offset, length);
+    for (int i = 0; i < 2; i++) {
+        memcpy(out, bytes.part[i], bytes.part_size[i]);
+        out += bytes.part_size[i];
+    }
+}
+
+RingBuffer::RingBuffer(size_t capacity) : buffer(capacity), head(0), count(0) {}
+
+ssize_t RingBuffer::read_from(int sock, size_t limit) {
+    size_t tail = (head + count) % buffer.size();
+    size_t free_left = min(free_space(), limit);
+
+    // The free space wraps around the end of the buffer if the tail is behind the head.
+    iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = buffer.data() + tail;
+    iov[0].iov_len = min(free_left, buffer.size() - tail);
+    if (iov[0].iov_len < free_left) {
+        iov[1].iov_base = buffer.data();
+        iov[1].iov_len = free_left - iov[0].iov_len;
+        iov_count = 2;
+    }
+
+    ssize_t rcv_len = readv(sock, iov, iov_count);
+    if (rcv_len > 0)
+        count += rcv_len;
+    return rcv_len;
+}
+
+void RingBuffer::append(const char *data, size_t length) {
+    if (length > free_space())
+        fatal("ring buffer overflow");
+
+    size_t tail = (head + count) % buffer.size();
+    size_t first = min(length, buffer.size() - tail);
+    memcpy(buffer.data() + tail, data, first);
+    memcpy(buffer.data(), data + first, length - first);
+    count += length;
+}
+
+RingSpan RingBuffer::peek(size_t offset, size_t length) const {
+    RingSpan result;
+    size_t start = (head + offset) % buffer.size();
+    result.part[0] = buffer.data() + start;
+    result.part_size[0] = min(length, buffer.size() - start);
+    if (result.part_size[0] < length) {
+        result.part[1] = buffer.data();
+        result.part_size[1] = length - result.part_size[0];
+    }
+    return result;
+}
+
+void RingBuffer::consume(size_t length) {
+    length = min(length, count);
+    head = (head + length) % buffer.size();
+    count -= length;
+    // Keeps reads contiguous for as long as possible.
+    if (count == 0)
+        head = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef DUZE_RING_BUFFER_H
+#define DUZE_RING_BUFFER_H
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// A read-only view of bytes kept in a ring buffer.
+// As the bytes may wrap around the end of the buffer, the view has up to two parts.
+struct RingSpan {
+    const char *part[2];
+    size_t part_size[2];
+
+    RingSpan() : part{nullptr, nullptr}, part_size{0, 0} {}
+
+    RingSpan(const char *data, size_t size) : part{data, nullptr}, part_size{size, 0} {}
+
+    size_t size() const {
+        return part_size[0] + part_size[1];
+    }
+
+    char operator[](size_t i) const {
+        return i < part_size[0] ? part[0][i] : part[1][i - part_size[0]];
+    }
+
+    // Returns a view of @length bytes starting at @offset of this view.
+    RingSpan sub(size_t offset, size_t length) const;
+
+    // Copies the viewed bytes into a string.
+    std::string to_string() const;
+
+    // Copies @length viewed bytes starting at @offset to @out.
+    void copy(size_t offset, size_t length, char *out) const;
+};
+
+// Fixed-capacity byte queue. Data is read straight from a socket into the free space
+// and handed out as views, so no byte is ever moved once it is stored.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity);
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t capacity() const {
+        return buffer.size();
+    }
+
+    size_t free_space() const {
+        return buffer.size() - count;
+    }
+
+    // Performs a single read of at most @limit bytes from socket @sock into the free space.
+    // Returns the result of the read.
+    ssize_t read_from(int sock, size_t limit = SIZE_MAX);
+
+    // Appends @length bytes from @data. Fails if they do not fit.
+    void append(const char *data, size_t length);
+
+    // Returns a view of @length stored bytes starting at @offset.
+    RingSpan peek(size_t offset, size_t length) const;
+
+    unsigned char byte_at(size_t offset) const {
+        return buffer[(head + offset) % buffer.size()];
+    }
+
+    // Drops @length bytes from the front of the buffer.
+    void consume(size_t length);
+
+private:
+    std::vector<char> buffer;
+    size_t head;
+    size_t count;
+};
+
+#endif //DUZE_RING_BUFFER_H
@@ -0,0 +1,515 @@
+#include <arpa/inet.h>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "io_uring.h"
+#include "my_time.h"
+#include "shard.h"
+#include "socket_manager.h"
+
+using namespace std;
+
+namespace {
+    const size_t queue_capacity = 1024;
+    // Gap between blocks of a burst, so that it does not overflow the client's socket.
+    const long long burst_pace = 1000;
+    // How often the shard publishes its totals for STATS reports.
+    const long long stats_period = 1000000;
+    // Room for a whole sendmmsg-sized batch of the fan-out.
+    const unsigned fanout_ring_entries = 512;
+    // Sends waiting for room in the socket of a station, a few blocks in every format.
+    const size_t send_queue_limit = 32;
+    // Gap between attempts to send queued blocks.
+    const long long send_retry = 1000;
+    // Most STATS replies of a shard in a second.
+    const int stats_replies_per_sec = 10;
+
+    bool is_loopback(const sockaddr_in &address) {
+        return ntohl(address.sin_addr.s_addr) >> 24 == 127;
+    }
+}
+
+size_t shard_of(const sockaddr_in &address, size_t shard_count) {
+    return (client_key(address) * 0x9E3779B97F4A7C15ull >> 32) % shard_count;
+}
+
+Shard::Shard(size_t index, vector<unique_ptr<Shard>> &shards, vector<StationInfo> &stations,
+             const proxy_params &params, LiveStats &live)
+    : index(index), shards(shards), stations(stations), params(params), live(live), finished(false),
+      membership(), fanout(), stats_window_start(0), stats_replies(0), queue_counters(),
+      blocks(queue_capacity), idle(true), stop_requested(false) {
+    long long timeout = params.agent_timeout * 1000000ll;
+
+    for (size_t i = 0; i < stations.size(); i++) {
+        // Only one socket joins the multicast group, the others get copies of group datagrams anyway.
+        string group = i == 0 && index == 0 ? params.multicast_address : "";
+        auto res = create_multicast_socket(group, stations[i].agent_port, params.shards > 1);
+        if (i == 0 && index == 0)
+            membership = res.second;
+        if (stations[i].agent_port == 0)
+            stations[i].agent_port = get_socket_port(res.first);
+
+        set_nonblocking(res.first);
+        agent_socks.push_back(res.first);
+        if (params.group_address != "") {
+            sockaddr_in group = sockaddr_in();
+            group.sin_family = AF_INET;
+            group.sin_port = htons(params.group_port + i);
+            if (inet_aton(params.group_address.c_str(), &group.sin_addr) == 0
+                    || !IN_MULTICAST(ntohl(group.sin_addr.s_addr)))
+                fatal("Invalid audio group address");
+            groups.push_back(group);
+
+            // The socket blocks, so that group datagrams wait for room in the device queue.
+            if (index == 0) {
+                int group_sock = poll_multicast_socket(params.group_address, params.group_port + i).first;
+                set_multicast_sender(group_sock, params.group_ttl, params.group_interface);
+                group_socks.push_back(group_sock);
+            }
+        }
+        last_metadata.push_back("");
+        history.emplace_back();
+        send_queues.emplace_back();
+
+        for (int f = 0; f < CLIENT_FORMATS; f++) {
+            ClientFormat format = (ClientFormat)f;
+            clients.emplace_back(new ClientTable(reactor.timers(), timeout));
+            if (params.pacing) {
+                pacers.emplace_back(new Pacer(reactor,
+                        [this, format](const shared_ptr<const Block> &block, const AddressSnapshot &recipients,
+                                       size_t first, size_t count) {
+                            send_block(block, format, recipients, first, count);
+                        },
+                        [this](const Block &block) {
+                            block_sent(block);
+                        }));
+            }
+        }
+
+        // Reads all messages from clients and responds to them,
+        // and sends queued blocks once the socket has room for them.
+        reactor.add(res.first, EPOLLIN | EPOLLOUT, [this, i](uint32_t events) {
+            if (events & EPOLLIN)
+                while (agent(i));
+            if (events & EPOLLOUT)
+                flush_sends(i);
+        });
+    }
+
+    send_timer = reactor.create_timer([this]() {
+        for (size_t i = 0; i < send_queues.size(); i++)
+            flush_sends(i);
+    });
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+        syserr("eventfd");
+    reactor.add(wakeup_fd, EPOLLIN, [this](uint32_t) {
+        drain_inbox();
+    });
+
+    stats_timer = reactor.create_timer([this]() {
+        publish_stats();
+        reactor.arm_timer(stats_timer, stats_period);
+    });
+    reactor.arm_timer(stats_timer, stats_period);
+}
+
+Shard::~Shard() {
+    for (size_t i = 0; i < agent_socks.size(); i++) {
+        if (i == 0 && index == 0 && params.multicast_address != "") {
+            close_multicast_socket(agent_socks[i], membership);
+        } else {
+            close_socket(agent_socks[i]);
+        }
+    }
+    for (int sock : group_socks)
+        close_socket(sock);
+    close_socket(wakeup_fd);
+}
+
+void Shard::start() {
+    worker = thread([this]() {
+        // Rings are not shared between threads, every shard has its own.
+        unique_ptr<IoUring> ring;
+        if (params.io_uring)
+            ring = IoUring::open(fanout_ring_entries);
+        set_fanout_ring(ring.get());
+        reactor.run(finished);
+        set_fanout_ring(nullptr);
+    });
+}
+
+void Shard::wake_up() {
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof one) < 0 && errno != EAGAIN)
+        syserr("write");
+}
+
+void Shard::publish(const shared_ptr<const Block> &block) {
+    if (!blocks.push(block))
+        return;
+
+    // Pairs with the fence in drain_inbox: either the shard sees the new block,
+    // or this thread sees that the shard went idle.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (idle.load(memory_order_relaxed) && idle.exchange(false))
+        wake_up();
+}
+
+void Shard::forward(const ControlMessage &message) {
+    {
+        lock_guard<mutex> guard(inbox_lock);
+        inbox_controls.push_back(message);
+    }
+    wake_up();
+}
+
+void Shard::stop() {
+    {
+        lock_guard<mutex> guard(inbox_lock);
+        stop_requested = true;
+    }
+    wake_up();
+    if (worker.joinable())
+        worker.join();
+}
+
+bool Shard::agent(size_t station) {
+    int sock = agent_socks[station];
+    sockaddr_in sender_address;
+    char buf[LIMIT_MAX_PAYLOAD];
+    Datagram datagram;
+
+    ssize_t rcv_len = udp_receive(sock, buf, sizeof buf, &sender_address, datagram);
+
+    if (rcv_len == WOULD_BLOCK)
+        return false;
+
+    // Every shard gets a copy of a group datagram, only the first one takes care of it.
+    if (rcv_len >= 0 && datagram.group && index != 0)
+        return true;
+
+    if (rcv_len < 0) {
+        cerr << "Incorrect UDP header\n";
+    } else if (datagram.type != DISCOVER && datagram.type != KEEPALIVE && datagram.type != STATS) {
+        cerr << "Unknown type\n";
+    } else {
+        ControlMessage control = {station, datagram.type, sender_address, decode_capabilities(datagram.payload)};
+        size_t owner = shard_of(sender_address, shards.size());
+        if (owner == index)
+            handle_control(control);
+        else
+            shards[owner]->forward(control);
+    }
+    return true;
+}
+
+void Shard::reply(int sock, const string &message, sockaddr_in &address, uint16_t type) {
+    fanout.errors += udp_write(sock, message, &address, type);
+}
+
+void Shard::handle_control(const ControlMessage &message) {
+    size_t station = message.station;
+    int sock = agent_socks[station];
+    sockaddr_in address = message.address;
+
+    if (message.type == STATS) {
+        answer_stats(station, address);
+    } else if (message.type == DISCOVER) {
+        reply(sock, stations[station].radio_name, address, IAM);
+        if (last_metadata[station] != "") {
+            reply(sock, last_metadata[station], address, METADATA);
+        }
+        uint32_t group_capabilities = CAP_SEQUENCE | CAP_GROUP;
+        if (!groups.empty() && (message.capabilities & group_capabilities) == group_capabilities) {
+            // The client listens to the group, it does not need to be registered.
+            reply(sock, encode_group(groups[station]), address, GROUP);
+            for (int f = 0; f < CLIENT_FORMATS; f++)
+                table(station, (ClientFormat)f).remove(address);
+        } else {
+            long long now = now_usec();
+            ClientFormat format = PLAIN_FORMAT;
+            if (message.capabilities & CAP_SEQUENCE) {
+                bool parity = (message.capabilities & CAP_FEC) && params.fec_group > 0;
+                format = parity ? PROTECTED_FORMAT : SEQUENCED_FORMAT;
+            }
+            // A client may change its capabilities with a new DISCOVER.
+            for (int f = 0; f < CLIENT_FORMATS; f++) {
+                if (f != format)
+                    table(station, (ClientFormat)f).remove(address);
+            }
+            if (!table(station, format).touch(address, now)) {
+                if (history[station].empty())
+                    table(station, format).add(address, now);
+                else
+                    start_burst(station, format, address);
+            }
+        }
+
+        // A DISCOVER sent to the first station is answered by every station,
+        // so that agents learn about all of them.
+        for (size_t i = 1; station == 0 && i < stations.size(); i++) {
+            reply(agent_socks[i], stations[i].radio_name, address, IAM);
+        }
+    } else {
+        for (int f = 0; f < CLIENT_FORMATS; f++) {
+            if (table(station, (ClientFormat)f).touch(address, now_usec()))
+                break;
+        }
+    }
+}
+
+void Shard::answer_stats(size_t station, sockaddr_in &address) {
+    bool registered = bursts.count(make_pair(station, client_key(address))) > 0;
+    for (int f = 0; f < CLIENT_FORMATS && !registered; f++)
+        registered = table(station, (ClientFormat)f).contains(address);
+    if (!registered && !is_loopback(address))
+        return;
+
+    long long now = now_usec();
+    if (now - stats_window_start >= 1000000) {
+        stats_window_start = now;
+        stats_replies = 0;
+    }
+    if (stats_replies == stats_replies_per_sec)
+        return;
+    stats_replies++;
+    reply(agent_socks[station], live.report(now), address, STATS);
+}
+
+void Shard::publish_stats() {
+    StatsTotals totals = StatsTotals();
+    for (auto &table : clients) {
+        totals.clients += table->size();
+        totals.expirations += table->expirations();
+    }
+    totals.datagrams = fanout.datagrams;
+    totals.syscalls = fanout.syscalls;
+    totals.send_dropped = queue_counters.dropped;
+    for (auto &queue : send_queues)
+        totals.send_queued += queue.size();
+    for (auto &pacer : pacers) {
+        totals.pacing_dropped += pacer->stats().dropped;
+        totals.pacing_queued += pacer->depth();
+    }
+    live.update(index + 1, totals, now_usec());
+}
+
+void Shard::drain_inbox() {
+    uint64_t count;
+    if (read(wakeup_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        syserr("read");
+
+    vector<ControlMessage> controls;
+    bool stopping;
+    {
+        lock_guard<mutex> guard(inbox_lock);
+        controls.swap(inbox_controls);
+        stopping = stop_requested;
+    }
+
+    for (auto &control : controls) {
+        handle_control(control);
+    }
+
+    shared_ptr<const Block> block;
+    while (true) {
+        while (blocks.pop(block)) {
+            if (block->type == METADATA)
+                last_metadata[block->station] = block->data;
+            if (block->type == AUDIO && params.burst_blocks > 0) {
+                auto &recent = history[block->station];
+                recent.push_back(block);
+                if (recent.size() > (size_t)params.burst_blocks)
+                    recent.pop_front();
+            }
+            for (auto &burst : bursts) {
+                if (burst.second.station == block->station)
+                    burst.second.pending.push_back(block);
+            }
+            // Held until every send below started, so that a pacer done with its table
+            // at once does not take the latency before the others.
+            send_started(*block);
+            bool sent = false;
+            for (int f = 0; f < CLIENT_FORMATS; f++) {
+                size_t position = block->station * CLIENT_FORMATS + f;
+                ClientTable &recipients = *clients[position];
+                if (params.pacing) {
+                    if (recipients.size() > 0) {
+                        send_started(*block);
+                        sent = true;
+                    }
+                    pacers[position]->push(block, recipients.snapshot(), block->received);
+                } else if (recipients.size() > 0) {
+                    send_block(block, (ClientFormat)f, recipients.snapshot(), 0, recipients.size());
+                    sent = true;
+                }
+            }
+            if (index == 0 && !groups.empty()) {
+                // Group sockets block, so they never need a queue.
+                ClientFormat format = params.fec_group > 0 ? PROTECTED_FORMAT : SEQUENCED_FORMAT;
+                size_t part = 0;
+                send_parts(*block, format, &groups[block->station], 1, group_socks[block->station], part,
+                           nullptr);
+                sent = true;
+            }
+            // The latency of a block is taken once, after every table and the group got it.
+            if (sent)
+                block_sent(*block);
+            else
+                unfinished.erase(block.get());
+        }
+        block.reset();
+
+        idle.store(true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (blocks.empty())
+            break;
+        idle.store(false);
+    }
+
+    if (stopping)
+        finished = true;
+}
+
+void Shard::send_block(const shared_ptr<const Block> &block, ClientFormat format,
+                       const AddressSnapshot &recipients, size_t first, size_t count) {
+    QueuedSend send{block, format, recipients, first, count, 0, FanoutPosition(), false};
+
+    // Nothing overtakes queued blocks, so that clients get them in order.
+    deque<QueuedSend> &queue = send_queues[block->station];
+    if (queue.empty() && send_parts(*block, format, recipients->data() + first, count,
+                                    agent_socks[block->station], send.part, &send.position))
+        return;
+
+    // Sends of a block still being fanned out hold its latency back until they finish,
+    // bursts of old blocks do not.
+    send.counted = unfinished.count(block.get()) > 0;
+    if (send.counted)
+        send_started(*block);
+    queue.push_back(send);
+    if (queue.size() > send_queue_limit) {
+        // The oldest audio block goes, metadata is small and worth keeping. The first
+        // one stays, as it may be sent in part already.
+        auto dropped = queue.begin() + 1;
+        while (dropped != queue.end() && dropped->block->type != AUDIO)
+            dropped++;
+        if (dropped == queue.end())
+            dropped = queue.begin() + 1;
+        QueuedSend lost = move(*dropped);
+        queue.erase(dropped);
+        finish_send(lost);
+        queue_counters.dropped++;
+    }
+    queue_counters.max_depth = max(queue_counters.max_depth, (unsigned long long)queue.size());
+    reactor.arm_timer(send_timer, send_retry);
+}
+
+bool Shard::send_parts(const Block &block, ClientFormat format, const sockaddr_in *addresses,
+                       size_t count, int sock, size_t &part, FanoutPosition *position) {
+    RingSpan data(block.data.data(), block.data.size());
+    if (format == PLAIN_FORMAT || block.type != AUDIO)
+        return udp_write_to_all(sock, data, addresses, count, block.type, fanout, nullptr, position);
+
+    if (part == 0) {
+        AudioSequence sequence = AudioSequence();
+        sequence.datagram = block.first_datagram;
+        sequence.block = block.number;
+        sequence.timestamp = block.received / 1000;
+        if (!udp_write_to_all(sock, data, addresses, count, AUDIO_SEQ, fanout, &sequence, position))
+            return false;
+        part = 1;
+    }
+    for (; format == PROTECTED_FORMAT && part <= block.parity.size(); part++) {
+        const string &parity = block.parity[part - 1];
+        if (!udp_write_to_all(sock, RingSpan(parity.data(), parity.size()), addresses, count, FEC,
+                              fanout, nullptr, position))
+            return false;
+    }
+    return true;
+}
+
+void Shard::flush_sends(size_t station) {
+    deque<QueuedSend> &queue = send_queues[station];
+    while (!queue.empty()) {
+        QueuedSend &send = queue.front();
+        if (!send_parts(*send.block, send.format, send.recipients->data() + send.first, send.count,
+                        agent_socks[station], send.part, &send.position)) {
+            reactor.arm_timer(send_timer, send_retry);
+            return;
+        }
+        QueuedSend sent = move(send);
+        queue.pop_front();
+        finish_send(sent);
+    }
+}
+
+void Shard::finish_send(const QueuedSend &send) {
+    if (send.counted)
+        block_sent(*send.block);
+}
+
+void Shard::send_started(const Block &block) {
+    unfinished[&block]++;
+}
+
+void Shard::block_sent(const Block &block) {
+    auto sends = unfinished.find(&block);
+    if (sends == unfinished.end() || --sends->second > 0)
+        return;
+    unfinished.erase(sends);
+    if (block.type == AUDIO)
+        live.latency(index + 1).record(now_usec() - block.received);
+}
+
+PacingStats Shard::pacing_stats() const {
+    PacingStats sum = PacingStats();
+    for (auto &pacer : pacers) {
+        sum.blocks += pacer->stats().blocks;
+        sum.dropped += pacer->stats().dropped;
+        sum.max_queue = max(sum.max_queue, pacer->stats().max_queue);
+    }
+    return sum;
+}
+
+void Shard::start_burst(size_t station, ClientFormat format, const sockaddr_in &address) {
+    auto key = make_pair(station, client_key(address));
+    auto it = bursts.find(key);
+    if (it != bursts.end()) {
+        it->second.format = format;
+        return;
+    }
+
+    Burst &burst = bursts[key];
+    burst.station = station;
+    burst.format = format;
+    burst.address = address;
+    burst.pending = history[station];
+    burst.timer = reactor.create_timer([this, key]() {
+        continue_burst(key);
+    });
+    reactor.arm_timer(burst.timer, 0);
+}
+
+void Shard::continue_burst(pair<size_t, uint64_t> key) {
+    auto it = bursts.find(key);
+    Burst &burst = it->second;
+
+    shared_ptr<const Block> block = burst.pending.front();
+    burst.pending.pop_front();
+    send_block(block, burst.format, make_shared<const vector<sockaddr_in>>(1, burst.address), 0, 1);
+
+    if (!burst.pending.empty()) {
+        reactor.arm_timer(burst.timer, burst_pace);
+        return;
+    }
+
+    // The client is up to date, from now on it gets blocks with everyone else.
+    table(burst.station, burst.format).add(burst.address, now_usec());
+    int timer = burst.timer;
+    bursts.erase(it);
+    reactor.timers().destroy(timer);
+}
@@ -0,0 +1,276 @@
+#ifndef DUZE_SHARD_H
+#define DUZE_SHARD_H
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client_table.h"
+#include "live_stats.h"
+#include "network.h"
+#include "pacer.h"
+#include "parser.h"
+#include "reactor.h"
+#include "spsc_queue.h"
+
+// A piece of a station's stream, copied once out of the demuxer and shared by all shards.
+struct Block {
+    size_t station;
+    uint16_t type;
+    std::string data;
+    // When the read completing the block returned, in microseconds.
+    long long received;
+    // Audio blocks of a station are numbered from 0, and so are their AUDIO_SEQ datagrams.
+    uint32_t number;
+    uint32_t first_datagram;
+    // FEC messages of an audio block, empty unless parity is on.
+    std::vector<std::string> parity;
+};
+
+// How a client wants its audio. The values index client tables of a station.
+enum ClientFormat {
+    // AUDIO datagrams of the original protocol.
+    PLAIN_FORMAT = 0,
+    // AUDIO_SEQ datagrams, for clients announcing CAP_SEQUENCE.
+    SEQUENCED_FORMAT = 1,
+    // AUDIO_SEQ and FEC datagrams, for clients announcing CAP_FEC too, when parity is on.
+    PROTECTED_FORMAT = 2,
+    CLIENT_FORMATS = 3
+};
+
+// What shards need to know about a relayed station.
+struct StationInfo {
+    std::string radio_name;
+    // Port of the station's agent sockets, 0 before the first shard binds it.
+    int agent_port;
+};
+
+// Counters of the send queues of a shard.
+struct SendQueueStats {
+    // Audio blocks dropped from full queues.
+    unsigned long long dropped;
+    unsigned long long max_depth;
+};
+
+// A DISCOVER or KEEPALIVE handed over to the shard owning the sender.
+struct ControlMessage {
+    size_t station;
+    uint16_t type;
+    sockaddr_in address;
+    // Sent with a DISCOVER.
+    uint32_t capabilities;
+};
+
+// A part of the agent side of the proxy, running in its own thread.
+// Every shard has its own agent socket for each station, bound with SO_REUSEPORT
+// to the same port as the sockets of other shards, and owns the clients whose
+// addresses hash to it. Blocks of all stations are published to every shard
+// through a lock-free queue, and the shard sends them to its own clients.
+// If the shard falls behind and its queue fills up, new blocks are dropped
+// for it, so that the upstream is never held back.
+// With a burst buffer, the shard keeps the most recent audio blocks and sends
+// them to every new client before it joins the fan-out, so that its player
+// does not wait for the next block. The history holds pointers to the shared
+// blocks, so it costs no copies.
+// With pacing, the fan-out of every station goes through a Pacer.
+// Clients announcing CAP_SEQUENCE get audio as AUDIO_SEQ, possibly followed
+// by parity, and are kept in separate tables, so that every format is
+// encoded once per block.
+// In group mode, the first shard also sends every block once to the station's
+// multicast group, and clients announcing CAP_GROUP are only told the group.
+// STATS requests are answered only for the local host and registered clients,
+// and only a few times a second, so that a spoofed request cannot turn the proxy
+// into a reflector of reports many times its size.
+// Sends the agent socket of a station has no room for wait in a bounded queue of
+// the station until the socket becomes writable. If the queue overflows, its oldest
+// audio block after the one being sent is dropped, so that an overloaded shard falls
+// behind instead of exiting.
+class Shard {
+public:
+    // Creates the sockets of shard @index. Shards must be created in order,
+    // as the first one picks the ports of additional stations.
+    // The shard publishes its totals as part @index + 1 of @live.
+    Shard(size_t index, std::vector<std::unique_ptr<Shard>> &shards,
+          std::vector<StationInfo> &stations, const proxy_params &params, LiveStats &live);
+
+    ~Shard();
+
+    // Starts the thread of the shard.
+    void start();
+
+    // Hands a block over to the shard. Called only by the ingest thread.
+    void publish(const std::shared_ptr<const Block> &block);
+
+    // Hands a control message over to the shard. Called by other shards.
+    void forward(const ControlMessage &message);
+
+    // Asks the shard to finish and waits for its thread.
+    void stop();
+
+    const FanoutStats &fanout_stats() const {
+        return fanout;
+    }
+
+    const ReactorStats &reactor_stats() const {
+        return reactor.stats();
+    }
+
+    const QueueStats &queue_stats() const {
+        return blocks.stats();
+    }
+
+    size_t queue_depth() const {
+        return blocks.depth();
+    }
+
+    // Pacing counters of all stations together. Read only after the shard stopped.
+    PacingStats pacing_stats() const;
+
+    // Send queue counters of all stations together. Read only after the shard stopped.
+    SendQueueStats send_queue_stats() const {
+        return queue_counters;
+    }
+
+private:
+    // Reads a message sent to the socket of a given station and handles it
+    // or forwards it to the owning shard. Returns false if no message was waiting.
+    bool agent(size_t station);
+
+    // Sends a reply to a client, counting datagrams the socket had no room for as failed.
+    void reply(int sock, const std::string &message, sockaddr_in &address, uint16_t type);
+
+    // Handles a message of a client owned by this shard.
+    void handle_control(const ControlMessage &message);
+
+    // Answers a STATS request of @address sent to station @station, if it may get one.
+    void answer_stats(size_t station, sockaddr_in &address);
+
+    // Hands the current totals of the shard over to the STATS reports.
+    void publish_stats();
+
+    // Takes everything out of the inbox and the block queue and handles it.
+    void drain_inbox();
+
+    // Wakes up the thread of the shard.
+    void wake_up();
+
+    // Client table of a given station and format.
+    ClientTable &table(size_t station, ClientFormat format) {
+        return *clients[station * CLIENT_FORMATS + format];
+    }
+
+    // Sends a block in a given format to @count addresses from position @first of
+    // @recipients, through the agent socket of the block's station, queueing what
+    // does not fit. Queued sends share the snapshot instead of copying it.
+    void send_block(const std::shared_ptr<const Block> &block, ClientFormat format,
+                    const AddressSnapshot &recipients, size_t first, size_t count);
+
+    // Sends the parts of a block to @count addresses through @sock, starting from part
+    // @part at @position, if it's not null. Every part is a message: the block itself
+    // and then its parity messages. Returns false if the socket ran out of room,
+    // leaving @part and @position at the place to resume from.
+    bool send_parts(const Block &block, ClientFormat format, const sockaddr_in *addresses,
+                    size_t count, int sock, size_t &part, FanoutPosition *position);
+
+    // Sends queued blocks of a station for as long as its socket has room.
+    void flush_sends(size_t station);
+
+    // Notes that one more send of a block is under way, and block_sent() will follow.
+    void send_started(const Block &block);
+
+    // Notes that a send of a block is finished, and takes the latency of the block
+    // once the last of them is.
+    void block_sent(const Block &block);
+
+    // Starts sending the history of a station to a new client.
+    void start_burst(size_t station, ClientFormat format, const sockaddr_in &address);
+
+    // Sends the next block of a burst, and registers the client after the last one.
+    void continue_burst(std::pair<size_t, uint64_t> key);
+
+    // A block waiting for room in the socket of its station.
+    struct QueuedSend {
+        std::shared_ptr<const Block> block;
+        ClientFormat format;
+        AddressSnapshot recipients;
+        size_t first;
+        size_t count;
+        size_t part;
+        FanoutPosition position;
+        // Whether the send is one of the block's sends under way, which ends with block_sent().
+        bool counted;
+    };
+
+    // Ends a queued send which went out or was dropped.
+    void finish_send(const QueuedSend &send);
+
+    // Catch-up of a new client: the history at the time of its DISCOVER,
+    // followed by blocks which came later.
+    struct Burst {
+        size_t station;
+        ClientFormat format;
+        sockaddr_in address;
+        std::deque<std::shared_ptr<const Block>> pending;
+        int timer;
+    };
+
+    size_t index;
+    std::vector<std::unique_ptr<Shard>> &shards;
+    const std::vector<StationInfo> &stations;
+    const proxy_params &params;
+    LiveStats &live;
+
+    Reactor reactor;
+    bool finished;
+    std::vector<int> agent_socks;
+    // CLIENT_FORMATS tables for every station.
+    std::vector<std::unique_ptr<ClientTable>> clients;
+    std::vector<std::string> last_metadata;
+    // The most recent audio blocks of each station.
+    std::vector<std::deque<std::shared_ptr<const Block>>> history;
+    // Bursts in progress, keyed by station and client.
+    std::map<std::pair<size_t, uint64_t>, Burst> bursts;
+    ip_mreq membership;
+    FanoutStats fanout;
+    int stats_timer;
+    // STATS replies sent since @stats_window_start.
+    long long stats_window_start;
+    int stats_replies;
+    // One for every client table, empty unless pacing is on.
+    std::vector<std::unique_ptr<Pacer>> pacers;
+    // Number of sends under way for blocks which are still being sent.
+    std::map<const Block *, size_t> unfinished;
+    // Blocks waiting for room in the agent socket of every station.
+    std::vector<std::deque<QueuedSend>> send_queues;
+    // Retries sends stopped by a full device queue, which does not make sockets writable.
+    int send_timer;
+    SendQueueStats queue_counters;
+    // Multicast group of every station, empty unless group mode is on.
+    std::vector<sockaddr_in> groups;
+    // Sockets sending to the groups, only in the first shard.
+    std::vector<int> group_socks;
+
+    // Blocks published by the ingest thread.
+    SpscQueue<std::shared_ptr<const Block>> blocks;
+    // Set while the shard has nothing to do, so that the ingest thread
+    // wakes it up only after the queue stops being empty.
+    std::atomic<bool> idle;
+
+    // Inbox, filled by other shards.
+    std::mutex inbox_lock;
+    std::vector<ControlMessage> inbox_controls;
+    bool stop_requested;
+    int wakeup_fd;
+
+    std::thread worker;
+};
+
+// Returns the index of the shard owning a client with a given address.
+size_t shard_of(const sockaddr_in &address, size_t shard_count);
+
+#endif //DUZE_SHARD_H
@@ -1,17 +1,55 @@
 #include <arpa/inet.h>
 #include <cstring>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <string>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
 
 #include "err.h"
 #include "socket_manager.h"
 
 using namespace std;
 
-int create_connected_socket(string address, int port) {
-    int sock;
+namespace {
+    // Connects @sock to @address, waiting at most @timeout seconds.
+    // Returns 0 on success, or an errno value describing the failure.
+    int connect_with_timeout(int sock, const addrinfo *address, int timeout) {
+        int flags = fcntl(sock, F_GETFL, 0);
+        if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+            syserr("fcntl");
+
+        int result = 0;
+        if (connect(sock, address->ai_addr, address->ai_addrlen) < 0) {
+            result = errno;
+            if (result == EINPROGRESS) {
+                pollfd pending = {sock, POLLOUT, 0};
+                int ready;
+                do {
+                    ready = poll(&pending, 1, timeout * 1000);
+                } while (ready < 0 && errno == EINTR);
+
+                if (ready < 0) {
+                    syserr("poll");
+                } else if (ready == 0) {
+                    result = ETIMEDOUT;
+                } else {
+                    socklen_t length = sizeof result;
+                    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &result, &length) < 0)
+                        syserr("getsockopt");
+                }
+            }
+        }
+
+        if (fcntl(sock, F_SETFL, flags) < 0)
+            syserr("fcntl");
+        return result;
+    }
+}
+
+int create_connected_socket(string address, int port, int timeout) {
     addrinfo addr_hints;
     addrinfo *addr_result;
 
@@ -31,21 +69,69 @@ int create_connected_socket(string address, int port) {
         fatal("getaddrinfo: %s", gai_strerror(err));
     }
 
-    // initialize socket according to getaddrinfo results
-    sock = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
-    if (sock < 0)
-        syserr("socket");
+    // try the addresses in order until one of them accepts the connection
+    int sock = -1;
+    int last_error = 0;
+    for (addrinfo *it = addr_result; it != NULL && sock < 0; it = it->ai_next) {
+        sock = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (sock < 0)
+            syserr("socket");
+
+        last_error = connect_with_timeout(sock, it, timeout);
+        if (last_error != 0) {
+            close_socket(sock);
+            sock = -1;
+        }
+    }
 
-    // connect socket to the server
-    if (connect(sock, addr_result->ai_addr, addr_result->ai_addrlen) < 0)
+    freeaddrinfo(addr_result);
+
+    if (sock < 0) {
+        errno = last_error;
         syserr("connect");
+    }
+    return sock;
+}
 
+vector<sockaddr_in> resolve_stream_addresses(string host, int port, string &error) {
+    addrinfo addr_hints;
+    addrinfo *addr_result;
+
+    memset(&addr_hints, 0, sizeof(addrinfo));
+    addr_hints.ai_family = AF_INET; // IPv4
+    addr_hints.ai_socktype = SOCK_STREAM;
+    addr_hints.ai_protocol = IPPROTO_TCP;
+
+    vector<sockaddr_in> addresses;
+    int err = getaddrinfo(host.c_str(), to_string(port).c_str(), &addr_hints, &addr_result);
+    if (err != 0) {
+        error = string("getaddrinfo: ") + gai_strerror(err);
+        return addresses;
+    }
+
+    for (addrinfo *it = addr_result; it != NULL; it = it->ai_next) {
+        sockaddr_in address;
+        memcpy(&address, it->ai_addr, sizeof address);
+        addresses.push_back(address);
+    }
     freeaddrinfo(addr_result);
+    return addresses;
+}
 
+int create_connecting_socket(const sockaddr_in &address, string &error) {
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+        syserr("socket");
+    set_nonblocking(sock);
+    if (connect(sock, (const sockaddr *)&address, sizeof address) < 0 && errno != EINPROGRESS) {
+        error = string("connect: ") + strerror(errno);
+        close_socket(sock);
+        sock = -1;
+    }
     return sock;
 }
 
-pair<int, ip_mreq> create_multicast_socket(string address, int port) {
+pair<int, ip_mreq> create_multicast_socket(string address, int port, bool reuse_port) {
     /* argumenty wywołania programu */
     in_port_t local_port;
 
@@ -61,6 +147,15 @@ pair<int, ip_mreq> create_multicast_socket(string address, int port) {
     if (sock < 0)
         syserr("socket");
 
+    if (reuse_port) {
+        int optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *) &optval, sizeof optval) < 0)
+            syserr("setsockopt reuseport");
+        // Tells which datagrams were sent to a group, as every socket receives a copy of them.
+        if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, (void *) &optval, sizeof optval) < 0)
+            syserr("setsockopt pktinfo");
+    }
+
     /* podłączenie do grupy rozsyłania (ang. multicast) */
     if (address != "") {
         char *multicast_dotted_address = (char *) address.c_str();
@@ -82,6 +177,35 @@ pair<int, ip_mreq> create_multicast_socket(string address, int port) {
     return make_pair(sock, ip_mreq);
 }
 
+int get_socket_port(int sock) {
+    sockaddr_in address;
+    socklen_t length = sizeof address;
+    if (getsockname(sock, (sockaddr *)&address, &length) < 0)
+        syserr("getsockname");
+    return ntohs(address.sin_port);
+}
+
+sockaddr_in resolve_address(string host, int port) {
+    addrinfo addr_hints;
+    addrinfo *addr_result;
+
+    memset(&addr_hints, 0, sizeof(addrinfo));
+    addr_hints.ai_family = AF_INET; // IPv4
+    addr_hints.ai_socktype = SOCK_DGRAM;
+
+    int err = getaddrinfo(host.c_str(), to_string(port).c_str(), &addr_hints, &addr_result);
+    if (err == EAI_SYSTEM) {
+        syserr("getaddrinfo");
+    } else if (err != 0) {
+        fatal(gai_strerror(err));
+    }
+
+    sockaddr_in address;
+    memcpy(&address, addr_result->ai_addr, sizeof address);
+    freeaddrinfo(addr_result);
+    return address;
+}
+
 pair<int, sockaddr_in> poll_multicast_socket(string host, int port) {
     /* argumenty wywołania programu */
     char *remote_dotted_address;
@@ -119,6 +243,20 @@ pair<int, sockaddr_in> poll_multicast_socket(string host, int port) {
     return make_pair(sock, remote_address);
 }
 
+void set_multicast_sender(int sock, int ttl, string interface) {
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void *) &ttl, sizeof ttl) < 0)
+        syserr("setsockopt multicast ttl");
+
+    if (interface != "") {
+        in_addr interface_address;
+        if (inet_aton(interface.c_str(), &interface_address) == 0)
+            fatal("inet_aton - invalid interface address");
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (void *) &interface_address,
+                       sizeof interface_address) < 0)
+            syserr("setsockopt multicast interface");
+    }
+}
+
 void create_poll(pollfd *client, sockaddr_in &multicast_address,
         string &host, int port, int control_port) {
 
@@ -152,6 +290,12 @@ void create_poll(pollfd *client, sockaddr_in &multicast_address,
         syserr("Starting to listen");
 }
 
+void set_nonblocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+        syserr("fcntl");
+}
+
 void close_multicast_socket(int sock, ip_mreq ip_mreq) {
     /* odłączenie od grupy rozsyłania */
     if (setsockopt(sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, (void*)&ip_mreq, sizeof ip_mreq) < 0)
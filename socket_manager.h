@@ -1,15 +1,44 @@
 #ifndef DUZE_SOCKET_MANAGER_H
 #define DUZE_SOCKET_MANAGER_H
 
+#include <netinet/in.h>
 #include <poll.h>
+#include <string>
+#include <vector>
 
 // Creates a socket connected to a given address on a given port.
-int create_connected_socket(std::string address, int port);
+// Every address the name resolves to is tried in turn, each for at most @timeout seconds.
+int create_connected_socket(std::string address, int port, int timeout);
+
+// Returns every address a given name and port resolve to for a TCP connection.
+// May block for long. Returns none, with the reason in @error, if the name does not resolve.
+std::vector<sockaddr_in> resolve_stream_addresses(std::string host, int port, std::string &error);
+
+// Creates a non-blocking socket and starts connecting it to @address, without
+// waiting for the connection. Returns -1 with the reason in @error if the
+// connection cannot be started.
+int create_connecting_socket(const sockaddr_in &address, std::string &error);
 
 // Creates a socket connected to a given address on a given port.
 // If address is not an empty string, it attaches given in it
 // multicast address to the socket.
-std::pair<int, ip_mreq> create_multicast_socket(std::string address, int port);
+// With @reuse_port, many sockets may be bound to the same port and the kernel
+// spreads incoming datagrams between them.
+std::pair<int, ip_mreq> create_multicast_socket(std::string address, int port, bool reuse_port = false);
+
+// Returns the local port a socket is bound to.
+int get_socket_port(int sock);
+
+// Resolves a given host name and port into an IPv4 address. Exits if it cannot.
+sockaddr_in resolve_address(std::string host, int port);
+
+// Opens a UDP socket able to send to a given (possibly multicast or broadcast)
+// address and port. Returns the socket and the parsed address.
+std::pair<int, sockaddr_in> poll_multicast_socket(std::string host, int port);
+
+// Lets socket @sock send to multicast groups with a given TTL, through the interface
+// with a given address, or the default one if @interface is empty.
+void set_multicast_sender(int sock, int ttl, std::string interface);
 
 // Sets up pollfd array.
 // The first socket is open and can send messages
@@ -19,6 +48,9 @@ std::pair<int, ip_mreq> create_multicast_socket(std::string address, int port);
 void create_poll(pollfd *client, sockaddr_in &multicast_address,
                  std::string &host, int port, int control_port);
 
+// Switches socket @sock to non-blocking mode.
+void set_nonblocking(int sock);
+
 // Closes a socket with a attached multicast address.
 void close_multicast_socket(int sock, ip_mreq ip_mreq);
 
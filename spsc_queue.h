@@ -0,0 +1,91 @@
+#ifndef DUZE_SPSC_QUEUE_H
+#define DUZE_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Counters of a queue, written by the producer.
+struct QueueStats {
+    std::atomic<unsigned long long> pushed;
+    std::atomic<unsigned long long> full;
+    std::atomic<unsigned long long> max_depth;
+
+    QueueStats() : pushed(0), full(0), max_depth(0) {}
+};
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// The head is written only by the consumer and the tail only by the producer,
+// and they are padded apart, so that the threads do not share a cache line.
+template <typename T>
+class SpscQueue {
+public:
+    // The capacity is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Appends an item. Returns false, and counts it, if the queue is full.
+    // Called only by the producer.
+    bool push(const T &item) {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        size_t depth = current_tail - head.load(std::memory_order_acquire);
+        if (depth == slots.size()) {
+            counters.full.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        slots[current_tail & mask] = item;
+        tail.store(current_tail + 1, std::memory_order_release);
+
+        counters.pushed.fetch_add(1, std::memory_order_relaxed);
+        if (depth + 1 > counters.max_depth.load(std::memory_order_relaxed))
+            counters.max_depth.store(depth + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Takes the oldest item out. Returns false if the queue is empty.
+    // Called only by the consumer.
+    bool pop(T &item) {
+        size_t current_head = head.load(std::memory_order_relaxed);
+        if (current_head == tail.load(std::memory_order_acquire))
+            return false;
+
+        // Moving leaves the slot empty, so it does not keep the item alive.
+        item = std::move(slots[current_head & mask]);
+        head.store(current_head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Number of items waiting. Exact only when called by one of the two threads.
+    size_t depth() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return depth() == 0;
+    }
+
+    const QueueStats &stats() const {
+        return counters;
+    }
+
+private:
+    static const size_t cache_line = 64;
+
+    std::vector<T> slots;
+    size_t mask;
+    char head_padding[cache_line];
+    std::atomic<size_t> head;
+    char tail_padding[cache_line];
+    std::atomic<size_t> tail;
+    char counters_padding[cache_line];
+    QueueStats counters;
+};
+
+#endif //DUZE_SPSC_QUEUE_H
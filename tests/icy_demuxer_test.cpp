@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../icy_demuxer.h"
+
+using namespace std;
+
+// Feeds canned ICY streams through IcyDemuxer and checks that it hands out the same
+// audio and metadata blocks, byte for byte, as the string-based splitting which
+// radio-proxy used before the ring buffer (send_package_if_necessary).
+// Streams are fed in reads of changing sizes, so that metadata is split across
+// reads and blocks wrap around the end of the ring.
+
+namespace {
+    struct Output {
+        uint16_t type;
+        string data;
+    };
+
+    struct Case {
+        const char *name;
+        int metaint;
+        bool metadata;
+        // Lengths of metadata blocks, in 16-byte units, used in turns.
+        vector<int> metadata_lengths;
+        // Sizes of reads, used in turns.
+        vector<size_t> read_sizes;
+        int blocks;
+    };
+
+    // What the demuxer went through while splitting a stream.
+    struct Coverage {
+        int wrapped_blocks = 0;
+        int split_metadata = 0;
+        int empty_metadata = 0;
+    };
+
+    // Returns a stream of @blocks audio blocks, each followed by metadata if it is on.
+    string make_stream(const Case &test) {
+        string stream;
+        for (int b = 0; b < test.blocks; b++) {
+            for (int i = 0; i < test.metaint; i++)
+                stream += (char)(b * 31 + i * 7);
+            if (!test.metadata)
+                continue;
+            int length = test.metadata_lengths[b % test.metadata_lengths.size()];
+            stream += (char)length;
+            for (int i = 0; i < 16 * length; i++)
+                stream += (char)('a' + (b + i) % 26);
+        }
+        return stream;
+    }
+
+    // The splitting of the old proxy loop, with sending replaced by saving to @out.
+    void send_package_if_necessary(string &package, int metaint, bool &metadata_now, bool metadata,
+                                   vector<Output> &out) {
+        while ((int)package.size() >= metaint || metadata_now) {
+            int ps = package.size();
+            if (metadata_now) {
+                if (!metadata) {
+                    metadata_now = false;
+                } else if (ps == 0) {
+                    break;
+                } else {
+                    unsigned char first = package[0];
+                    if (ps <= 16 * first)
+                        break;
+
+                    out.push_back(Output{METADATA, package.substr(0, 16 * first + 1)});
+                    package = package.substr(16 * first + 1);
+                    metadata_now = false;
+                }
+            } else {
+                out.push_back(Output{AUDIO, package.substr(0, metaint)});
+                package = package.substr(metaint);
+                metadata_now = true;
+            }
+        }
+    }
+
+    vector<Output> split_old(const Case &test, const string &stream) {
+        vector<Output> out;
+        string package;
+        bool metadata_now = false;
+        size_t position = 0;
+        for (size_t r = 0; position < stream.size(); r++) {
+            size_t length = min(test.read_sizes[r % test.read_sizes.size()], stream.size() - position);
+            package += stream.substr(position, length);
+            position += length;
+            send_package_if_necessary(package, test.metaint, metadata_now, test.metadata, out);
+        }
+        return out;
+    }
+
+    vector<Output> split_new(const Case &test, const string &stream, Coverage &coverage) {
+        vector<Output> out;
+        IcyDemuxer demuxer(test.metaint, test.metadata);
+        size_t position = 0;
+        for (size_t r = 0; position < stream.size(); r++) {
+            // A read never takes more than the free space, like RingBuffer::read_from.
+            size_t length = min(test.read_sizes[r % test.read_sizes.size()], stream.size() - position);
+            length = min(length, demuxer.buffer().free_space());
+            demuxer.buffer().append(stream.data() + position, length);
+            position += length;
+
+            IcyBlock block;
+            while (demuxer.next(block)) {
+                if (block.data.part_size[1] > 0)
+                    coverage.wrapped_blocks++;
+                if (block.type == METADATA && block.data.size() == 1)
+                    coverage.empty_metadata++;
+                out.push_back(Output{block.type, block.data.to_string()});
+            }
+            // The read stopped in the middle of a metadata block.
+            if (demuxer.buffer().size() > 0 && !out.empty() && out.back().type == AUDIO && test.metadata)
+                coverage.split_metadata++;
+        }
+        return out;
+    }
+
+    // Runs a case, adding what the demuxer went through to @coverage.
+    // Returns whether both splittings agree.
+    bool run(const Case &test, Coverage &coverage) {
+        string stream = make_stream(test);
+        int wrapped = coverage.wrapped_blocks;
+        vector<Output> expected = split_old(test, stream);
+        vector<Output> got = split_new(test, stream, coverage);
+
+        bool ok = true;
+        if (got.size() != expected.size()) {
+            cerr << test.name << ": " << got.size() << " blocks instead of " << expected.size() << "\n";
+            ok = false;
+        }
+        for (size_t i = 0; ok && i < got.size(); i++) {
+            if (got[i].type != expected[i].type || got[i].data != expected[i].data) {
+                cerr << test.name << ": block " << i << " differs\n";
+                ok = false;
+            }
+        }
+
+        cout << (ok ? "ok   " : "FAIL ") << test.name << " (" << got.size() << " blocks, "
+             << coverage.wrapped_blocks - wrapped << " wrapped)\n";
+        return ok;
+    }
+}
+
+int main() {
+    vector<Case> cases = {
+        {"small reads", 100, true, {0, 1, 3, 0, 255}, {1, 2, 3, 7, 16, 17}, 300},
+        {"mixed reads", 8192, true, {2, 0, 255, 1}, {4096, 1, 1000, 17, 8191, 3}, 200},
+        {"reads bigger than blocks", 50, true, {0, 1, 2}, {5000, 333, 4097}, 2000},
+        {"single byte blocks", 1, true, {0, 0, 1}, {1, 2, 5}, 3000},
+        {"no metadata", 1000, false, {}, {1, 4096, 999, 3}, 500},
+    };
+
+    bool ok = true;
+    Coverage coverage;
+    for (const Case &test : cases)
+        ok = run(test, coverage) && ok;
+
+    // The cases are only worth something if they went through the corners.
+    if (coverage.wrapped_blocks == 0 || coverage.split_metadata == 0 || coverage.empty_metadata == 0) {
+        cerr << "Not covered: " << coverage.wrapped_blocks << " wrapped blocks, "
+             << coverage.split_metadata << " split metadata, " << coverage.empty_metadata << " empty metadata\n";
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "timer_wheel.h"
+
+using namespace std;
+
+namespace {
+    const int LEVELS = 4;
+    const int BITS = 6;
+    const long long SLOTS = 1 << BITS;
+    const long long MASK = SLOTS - 1;
+
+    // Timers further away are kept in the last level until they come closer.
+    const long long MAX_DELTA = (1ll << (LEVELS * BITS)) - 1;
+}
+
+TimerWheel::TimerWheel(long long tick_usec, long long now)
+    : tick_usec(tick_usec), current_tick(now / tick_usec), armed(0), heads(LEVELS * SLOTS, -1) {}
+
+int TimerWheel::create(Callback callback) {
+    int timer;
+    if (free_nodes.empty()) {
+        timer = nodes.size();
+        nodes.push_back(Node());
+    } else {
+        timer = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    nodes[timer].callback = callback;
+    nodes[timer].slot = -1;
+    return timer;
+}
+
+void TimerWheel::destroy(int timer) {
+    cancel(timer);
+    free_nodes.push_back(timer);
+}
+
+void TimerWheel::link(int timer) {
+    Node &node = nodes[timer];
+    long long delta = min(node.expires - current_tick, MAX_DELTA);
+    long long position = current_tick + delta;
+
+    int level = 0;
+    while (delta >= (SLOTS << (BITS * level)))
+        level++;
+    node.slot = level * SLOTS + ((position >> (BITS * level)) & MASK);
+
+    node.prev = -1;
+    node.next = heads[node.slot];
+    if (node.next >= 0)
+        nodes[node.next].prev = timer;
+    heads[node.slot] = timer;
+}
+
+void TimerWheel::unlink(int timer) {
+    Node &node = nodes[timer];
+    if (node.prev >= 0)
+        nodes[node.prev].next = node.next;
+    else
+        heads[node.slot] = node.next;
+    if (node.next >= 0)
+        nodes[node.next].prev = node.prev;
+    node.slot = -1;
+}
+
+void TimerWheel::schedule(int timer, long long when) {
+    if (pending(timer))
+        unlink(timer);
+    else
+        armed++;
+
+    nodes[timer].expires = max((when + tick_usec - 1) / tick_usec, current_tick + 1);
+    link(timer);
+}
+
+void TimerWheel::cancel(int timer) {
+    if (pending(timer)) {
+        unlink(timer);
+        armed--;
+    }
+}
+
+void TimerWheel::cascade(int level) {
+    int slot = level * SLOTS + ((current_tick >> (BITS * level)) & MASK);
+    int timer = heads[slot];
+    heads[slot] = -1;
+    while (timer >= 0) {
+        int next = nodes[timer].next;
+        link(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::advance(long long now) {
+    long long target = now / tick_usec;
+    if (armed == 0 && current_tick < target)
+        current_tick = target;
+
+    while (current_tick < target) {
+        current_tick++;
+
+        for (int level = 1; level < LEVELS; level++) {
+            if ((current_tick >> (BITS * (level - 1))) & MASK)
+                break;
+            cascade(level);
+        }
+
+        int slot = current_tick & MASK;
+        while (heads[slot] >= 0) {
+            int timer = heads[slot];
+            unlink(timer);
+            armed--;
+            nodes[timer].callback();
+        }
+    }
+}
+
+long long TimerWheel::next_timeout(long long now) const {
+    if (armed == 0)
+        return -1;
+
+    // Looks for the first busy slot of the lowest level, but no further than
+    // the next cascade, which may bring timers from higher levels.
+    long long tick = current_tick + 1;
+    while ((tick & MASK) != 0 && heads[tick & MASK] < 0)
+        tick++;
+    return max(tick * tick_usec - now, 0ll);
+}
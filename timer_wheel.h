@@ -0,0 +1,70 @@
+#ifndef DUZE_TIMER_WHEEL_H
+#define DUZE_TIMER_WHEEL_H
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Hierarchical timer wheel.
+// Scheduling, rescheduling and cancelling a timer take constant time and never
+// allocate, and advancing the wheel costs work proportional to the number of
+// timers that expire, not to the number of timers waiting.
+// Times are given in microseconds of the monotonic clock (see my_time.h).
+class TimerWheel {
+public:
+    typedef std::function<void()> Callback;
+
+    TimerWheel(long long tick_usec, long long now);
+
+    // Creates a disarmed timer calling @callback when it expires. Returns its id.
+    int create(Callback callback);
+
+    // Cancels the timer and frees its id for reuse.
+    // A callback may destroy its own timer, but must not create timers afterwards.
+    void destroy(int timer);
+
+    // Makes the timer expire at moment @when. Replaces any previous schedule.
+    void schedule(int timer, long long when);
+
+    // Disarms the timer.
+    void cancel(int timer);
+
+    bool pending(int timer) const {
+        return nodes[timer].slot >= 0;
+    }
+
+    // Calls callbacks of all timers which expired until moment @now.
+    void advance(long long now);
+
+    // Returns the number of microseconds after which advance should be called,
+    // or -1 if no timer is armed.
+    long long next_timeout(long long now) const;
+
+private:
+    struct Node {
+        Callback callback;
+        long long expires;
+        int slot;
+        int prev;
+        int next;
+    };
+
+    void link(int timer);
+
+    void unlink(int timer);
+
+    // Moves the timers of a higher level slot to the levels below.
+    void cascade(int level);
+
+    long long tick_usec;
+    long long current_tick;
+    size_t armed;
+
+    // A deque keeps running callbacks in place when new timers are created.
+    std::deque<Node> nodes;
+    std::vector<int> free_nodes;
+    std::vector<int> heads;
+};
+
+#endif //DUZE_TIMER_WHEEL_H
@@ -0,0 +1,194 @@
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "socket_manager.h"
+#include "upstream.h"
+
+using namespace std;
+
+string stream_request(const station_params &source, int metadata) {
+    string message = "GET " + source.resource + " HTTP/1.1\r\n";
+    message += "Host: " + source.host + "\r\n";
+    message += "Icy-MetaData:" + to_string(metadata) + "\r\n\r\n";
+    return message;
+}
+
+int stream_metaint(const IcyHeaderParser &header, int &metadata, string &error) {
+    if (!header.status_ok()) {
+        error = "Response status differs from 200 OK";
+        return 0;
+    }
+
+    int metaint = default_package_size;
+    if (metadata && header.has_metaint()) {
+        metaint = header.metaint();
+    } else if (metadata) {
+        metadata = false;
+    } else if (header.has_metaint()) {
+        error = "Server forces metadata";
+        return 0;
+    }
+    if (metaint <= 0) {
+        error = "Invalid metaint";
+        return 0;
+    }
+    return metaint;
+}
+
+UpstreamSource resolve_source(const station_params &source) {
+    UpstreamSource resolved;
+    resolved.params = source;
+    resolved.addresses = resolve_stream_addresses(source.host, source.port, resolved.error);
+    return resolved;
+}
+
+UpstreamConnection::UpstreamConnection(Reactor &reactor, int timer, const UpstreamSource &source,
+                                       int metadata, int timeout, Callback ready, Callback failed)
+    : reactor(reactor), timer(timer), timeout_usec(timeout * 1000000ll), addresses(source.addresses),
+      next_address(0), metadata(metadata), request(stream_request(source.params, metadata)),
+      on_ready(ready), on_failed(failed), sock(-1), state(CONNECTING), reason(source.error) {
+    connect_next();
+}
+
+void UpstreamConnection::connect_next() {
+    state = CONNECTING;
+    while (next_address < addresses.size()) {
+        sock = create_connecting_socket(addresses[next_address++], reason);
+        if (sock >= 0) {
+            reactor.add(sock, EPOLLIN | EPOLLOUT, [this](uint32_t events) {
+                handle(events);
+            });
+            reactor.arm_timer(timer, timeout_usec);
+            return;
+        }
+    }
+    // Failures are reported from the loop, like all the others.
+    reactor.arm_timer(timer, 0);
+}
+
+UpstreamConnection::~UpstreamConnection() {
+    reactor.timers().cancel(timer);
+    if (sock >= 0 && state != TAKEN) {
+        reactor.remove(sock);
+        close_socket(sock);
+    }
+}
+
+void UpstreamConnection::expired() {
+    bool connecting = state == CONNECTING || state == CONNECT_FAILED;
+    if (connecting && sock >= 0) {
+        if (state == CONNECTING)
+            reason = string("connect: ") + strerror(ETIMEDOUT);
+        reactor.remove(sock);
+        close_socket(sock);
+        sock = -1;
+    }
+    if (connecting && next_address < addresses.size()) {
+        connect_next();
+        return;
+    }
+    fail(reason.empty() ? "Connection lost" : reason);
+}
+
+int UpstreamConnection::take(unique_ptr<IcyDemuxer> &demuxer, int &metadata) {
+    reactor.remove(sock);
+    reactor.timers().cancel(timer);
+    state = TAKEN;
+    demuxer = move(this->demuxer);
+    metadata = this->metadata;
+    return sock;
+}
+
+void UpstreamConnection::handle(uint32_t events) {
+    if (state == CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int result = 0;
+        socklen_t length = sizeof result;
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &result, &length) < 0)
+            syserr("getsockopt");
+        if (result != 0) {
+            reason = string("connect: ") + strerror(result);
+            state = CONNECT_FAILED;
+            reactor.arm_timer(timer, 0);
+            return;
+        }
+        // The request is small enough to always fit an empty socket buffer.
+        if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+            fail("Request not sent");
+            return;
+        }
+        state = HEADER;
+    }
+
+    if (state == HEADER)
+        read_header();
+    else if (state == READY)
+        read_stream();
+}
+
+void UpstreamConnection::read_header() {
+    char buf[4096];
+    while (state == HEADER) {
+        ssize_t rcv_len = read(sock, buf, sizeof buf);
+        if (!received(rcv_len))
+            return;
+
+        size_t header_part = header.feed(buf, rcv_len);
+        if (!header.done())
+            continue;
+
+        int metaint = stream_metaint(header, metadata, reason);
+        if (metaint == 0) {
+            fail(reason);
+            return;
+        }
+        demuxer.reset(new IcyDemuxer(metaint, metadata));
+        demuxer->buffer().append(buf + header_part, rcv_len - header_part);
+        drop_blocks();
+        state = READY;
+        on_ready();
+    }
+    read_stream();
+}
+
+void UpstreamConnection::read_stream() {
+    while (state == READY) {
+        if (!received(demuxer->buffer().read_from(sock)))
+            return;
+        drop_blocks();
+    }
+}
+
+void UpstreamConnection::drop_blocks() {
+    IcyBlock block;
+    while (demuxer->next(block)) {}
+}
+
+bool UpstreamConnection::received(ssize_t rcv_len) {
+    if (rcv_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    } else if (rcv_len < 0) {
+        fail(string("read: ") + strerror(errno));
+        return false;
+    } else if (rcv_len == 0) {
+        fail("Connection terminated");
+        return false;
+    }
+    reactor.arm_timer(timer, timeout_usec);
+    return true;
+}
+
+void UpstreamConnection::fail(const string &why) {
+    if (state == FAILED || state == TAKEN)
+        return;
+    state = FAILED;
+    reason = why;
+    reactor.timers().cancel(timer);
+    on_failed();
+}
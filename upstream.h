@@ -0,0 +1,123 @@
+#ifndef DUZE_UPSTREAM_H
+#define DUZE_UPSTREAM_H
+
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+#include "icy_demuxer.h"
+#include "icy_header.h"
+#include "parser.h"
+#include "reactor.h"
+
+// Size of audio blocks of servers which send no metadata.
+const int default_package_size = 4000;
+
+// Returns the GET request for the stream of @source, asking for metadata if @metadata is set.
+std::string stream_request(const station_params &source, int metadata);
+
+// Checks the response header of a server and picks the size of audio blocks.
+// Clears @metadata if the server does not send it.
+// Returns the metaint, or 0 with the reason in @error if the stream cannot be relayed.
+int stream_metaint(const IcyHeaderParser &header, int &metadata, std::string &error);
+
+// A server of a station, with the addresses its name resolved to.
+struct UpstreamSource {
+    station_params params;
+    std::vector<sockaddr_in> addresses;
+    // Why the name did not resolve, if it did not.
+    std::string error;
+};
+
+// Resolves the name of the server @source. May block for long, so servers are
+// resolved once, before the proxy starts relaying.
+UpstreamSource resolve_source(const station_params &source);
+
+// A connection to a server of a station, set up by a Reactor in the background while
+// another connection relays the station. It connects, sends the request and reads the
+// response header without blocking. Every address of the server is tried in turn.
+// Once ready, it keeps reading the stream and throws complete blocks away, so that
+// it stays current and can take over at a block boundary.
+class UpstreamConnection {
+public:
+    typedef std::function<void()> Callback;
+
+    // Starts connecting to @source, asking for metadata if @metadata is set.
+    // An address is given up if it does not accept the connection within @timeout
+    // seconds, and the connection fails if the server is silent for as long. Both are
+    // measured with timer @timer of @reactor, whose callback has to call expired().
+    // Calls @ready once the stream can be taken over, and @failed once the connection
+    // failed. Neither may destroy the connection.
+    UpstreamConnection(Reactor &reactor, int timer, const UpstreamSource &source, int metadata,
+                       int timeout, Callback ready, Callback failed);
+
+    // Closes the connection, unless it was taken over.
+    ~UpstreamConnection();
+
+    // Moves on to the next address after a failed or slow connect, or fails
+    // the connection, as the server was silent for too long.
+    void expired();
+
+    bool is_ready() const {
+        return state == READY;
+    }
+
+    bool has_failed() const {
+        return state == FAILED;
+    }
+
+    // Why the connection failed.
+    const std::string &error() const {
+        return reason;
+    }
+
+    // Stops reading a ready connection and hands it over. Saves the demuxer holding
+    // the beginning of the current block to @demuxer, and the metadata mode of the
+    // stream to @metadata. Returns the non-blocking socket.
+    int take(std::unique_ptr<IcyDemuxer> &demuxer, int &metadata);
+
+private:
+    // After a failed connect, the next address is tried from the timer,
+    // as the handler of the socket cannot remove itself.
+    enum State {CONNECTING, CONNECT_FAILED, HEADER, READY, FAILED, TAKEN};
+
+    // Starts connecting to the next address which accepts a connect.
+    // If none is left, arms the timer to fail the connection from the loop.
+    void connect_next();
+
+    // Takes action after events @events of the socket.
+    void handle(uint32_t events);
+
+    // Reads the response header, and the stream once it ends.
+    void read_header();
+
+    // Reads the stream, dropping complete blocks.
+    void read_stream();
+
+    // Drops the complete blocks gathered by the demuxer.
+    void drop_blocks();
+
+    // Checks the result @rcv_len of a read. Returns false if there is nothing more to read.
+    bool received(ssize_t rcv_len);
+
+    void fail(const std::string &why);
+
+    Reactor &reactor;
+    int timer;
+    long long timeout_usec;
+    std::vector<sockaddr_in> addresses;
+    size_t next_address;
+    int metadata;
+    std::string request;
+    Callback on_ready;
+    Callback on_failed;
+    int sock;
+    State state;
+    IcyHeaderParser header;
+    std::unique_ptr<IcyDemuxer> demuxer;
+    std::string reason;
+};
+
+#endif //DUZE_UPSTREAM_H